@@ -1,7 +1,25 @@
+// wcwidth and the wide character curses calls are only declared for X/Open
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <langinfo.h>
+#include <limits.h>
+#include <locale.h>
 #include <ncurses.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef struct line line;
 struct line
@@ -13,7 +31,23 @@ struct line
     char* gap_start;
     char* gap_end;
     int number_characters;
+    // The columns the line's text takes on screen, which is its byte count for plain ASCII
+    int width;
+    // Counted from the start of the line's paragraph, since lines only come and go at its end
     int line_number;
+    // A paragraph buffer of wider characters keeps where each of its rows starts, fitted again from the edited row on after an edit
+    int* row_starts;
+    int row_count;
+    int row_capacity;
+    int row_columns;
+};
+
+// A run of text in the mapped file or the add buffer, as a paragraph edited with -t is kept between builds
+typedef struct piece_span piece_span;
+struct piece_span
+{
+    char* text;
+    long length;
 };
 
 typedef struct paragraph paragraph;
@@ -23,35 +57,335 @@ struct paragraph
     line* paragraph_end;
     paragraph* previous_paragraph;
     paragraph* next_paragraph;
+
+    // Lazy paragraphs have no lines yet and point at one or more paragraphs of text in the mapped file
+    char* source_start;
+    char* source_end;
+    int source_paragraphs;
+    int source_lines;
+
+    // With -t an edited paragraph keeps the pieces it was built from, and goes back to the ones its edits left alone with only the new text between them
+    piece_span* spans;
+    int span_count;
+
+    // Packed paragraphs are lazy paragraphs whose text is compressed into a block of their own instead
+    char* packed_text;
+    int packed_size;
+    int unpacked_size;
+
+    // The edit that last changed the paragraph, or 0 if none has
+    int last_edit;
+
+    // The screen width the paragraph was wrapped or counted at, left behind by a resize until the paragraph is next needed
+    int width;
+
+    // Paragraphs also sit in a treap in document order, each node counting the lines under it so line numbers are found in O(log n)
+    paragraph* tree_parent;
+    paragraph* tree_left;
+    paragraph* tree_right;
+    int tree_priority;
+    int line_count;
+    int tree_lines;
+};
+
+// Lazy paragraphs are cut at the first new line after this many bytes
+#define LAZY_BLOCK_SIZE (1 << 20)
+
+// A paragraph edited into more pieces than this has all but its first and last copied into one the next time it is released
+#define PIECE_SPANS_MAX 16
+
+// Neighbouring edited paragraphs are packed together into blocks of about this much text, once no edit has touched them for a while
+#define PACK_BLOCK_SIZE (64 << 10)
+#define PACK_COLD_EDITS 256
+
+// The compressor looks for repeats through a hash table of this many bits, and only as far back as a two byte offset reaches
+#define PACK_HASH_BITS 12
+#define PACK_MAX_OFFSET 65535
+#define PACK_MIN_MATCH 4
+
+// Each loader thread gets at least this many bytes of the file to build
+#define LOAD_CHUNK_SIZE (4 << 20)
+#define MAX_LOAD_CHUNKS 256
+
+// How often in milliseconds the screen is refreshed while a background save is running
+#define SAVE_STATUS_INTERVAL 100
+
+// How often in milliseconds follow mode looks for text appended to the file, and how much it takes in per look
+#define FOLLOW_INTERVAL 100
+#define FOLLOW_READ_SIZE (1 << 20)
+#define FOLLOW_READ_LIMIT (16 << 20)
+
+// Saving copies lines into a staging buffer of this size so the file gets a few large writes
+#define SAVE_BUFFER_SIZE (1 << 20)
+
+typedef struct save_buffer save_buffer;
+struct save_buffer
+{
+    char* text;
+    long used;
+    long long written;
+    int failed;
+    FILE* write_file;
+};
+
+// A cell of the screen drawn by -v holds the UTF-8 of a character and as many marks on it as curses would keep
+#define CELL_TEXT_SIZE (4 * CCHARW_MAX)
+
+typedef struct screen_cell screen_cell;
+struct screen_cell
+{
+    char text[CELL_TEXT_SIZE];
+    // The right half of a wide character has no text of its own
+    unsigned char length;
+};
+
+// The journal starts with a header naming the file it applies to, followed by one record per edit
+#define JOURNAL_MAGIC "CURSJNL1"
+#define JOURNAL_INSERT 0
+#define JOURNAL_DELETE 1
+#define JOURNAL_SPLIT 2
+#define JOURNAL_MERGE 3
+#define JOURNAL_READ_RECORDS 4096
+
+typedef struct journal_header journal_header;
+struct journal_header
+{
+    char magic[8];
+    long long file_size;
+    long long file_modified_seconds;
+    long long file_modified_nanoseconds;
+};
+
+typedef struct journal_record journal_record;
+struct journal_record
+{
+    int operation;
+    int input;
+    int paragraph_index;
+    int offset;
+};
+
+// The index file records how the lazy blocks of a file were counted at one terminal width
+#define INDEX_MAGIC "CURSIDX2"
+
+// Checking a file against its index hashes this many bytes from every stride of the file instead of all of it
+#define INDEX_SAMPLE_SIZE 4096
+#define INDEX_SAMPLE_STRIDE (1 << 20)
+
+typedef struct index_header index_header;
+struct index_header
+{
+    char magic[8];
+    long long file_size;
+    long long file_modified_seconds;
+    long long file_modified_nanoseconds;
+    unsigned long long sample_hash;
+    int width;
+    int block_count;
+};
+
+typedef struct index_block index_block;
+struct index_block
+{
+    long long source_start;
+    long long source_end;
+    int source_paragraphs;
+    int source_lines;
+};
+
+// Lines, paragraphs and line buffers are carved out of slabs this big and reused through free lists
+#define POOL_SLAB_SIZE (1 << 20)
+#define POOL_SLAB_HEADER 16
+
+// Line buffers come in sizes doubling up from this one, each size with its own pool, the largest leaving room for rows of combining marks
+#define LINE_BUFFER_MINIMUM 16
+#define LINE_BUFFER_CLASSES 24
+
+typedef struct pool pool;
+struct pool
+{
+    size_t item_size;
+    void* free_items;
+    char* slab_next;
+    char* slab_end;
+    void* slabs;
+};
+
+typedef struct load_chunk load_chunk;
+struct load_chunk
+{
+    pthread_t thread;
+    char* text;
+    char* text_end;
+    paragraph* first_paragraph;
+    paragraph* last_paragraph;
+
+    // Whatever the thread building the chunk allocated, handed back to the main thread's pools
+    pool line_pool;
+    pool paragraph_pool;
+    pool buffer_pools[LINE_BUFFER_CLASSES];
+    long long line_memory;
 };
 
 // Functions for altering the buffer
+int edit_at_cursor(int input, paragraph** cursor_paragraph, line** cursor_line);
 void addat_cursor(int input, line* current_line);
 void move_left_one(line* current_line);
 void move_right_one(line* current_line);
 void move_cursor_to(line* line, int destination);
 void delete(line* current_line);
-void shuffle_end(paragraph* current_paragraph, line* current_line, int line_counter);
-void shuffle_start(paragraph* current_paragraph, line* current_line);
-void copy_lines(line* current_line, paragraph* target_paragraph);
+int grow_line(line* current_line, int capacity);
+int buffer_class(int capacity);
+int wrap_lines(paragraph* current_paragraph, line* edited_line, line** cursor_line);
+int line_overflows(line* current_line);
+line* copy_lines(line* current_line, paragraph* target_paragraph);
+line* append_text(paragraph* target_paragraph, char* text, long length);
+
+// Text functions
+long ascii_length(char* text, char* text_end);
+int decode_character(char* text, char* text_end, int* codepoint);
+int encode_character(int codepoint, char* text);
+int character_width(int codepoint);
+int next_character(char* text, char* text_end, int* width);
+int previous_character(char* text_start, char* text, int* width);
+int text_width(char* text, char* text_end);
+char* fit_text(char* text, char* text_end, int columns, int* width);
+int count_rows(char* text, char* text_end);
+char* seek_text_row(char* text, char* text_end, int row);
+void print_text(char* text, char* text_end);
+int read_character(int input);
+long complete_length(char* text, long length);
+
+// Row functions
+int character_after(line* current_line, int offset, int* width);
+int character_before(line* current_line, int offset, int* width);
+int row_end(line* current_line, int start, int columns, int* row_width);
+int row_start(line* current_line, int offset, int* row);
+int row_last(line* current_line, int start);
+int row_column(line* current_line, int start, int offset);
+int column_offset(line* current_line, int start, int column);
+int line_rows(line* current_line, int columns);
+int seek_row(line* current_line, int row);
+int index_rows(line* current_line);
+int find_row(line* current_line, int offset);
+void refit_rows(line* current_line, int offset, int removed, int added);
+int grow_rows(line* current_line, int count);
+void drop_rows(line* current_line);
+void print_line_text(line* current_line, int start, int end);
 
 // Data structure functions
 line* add_line(line* document_start);
 void free_lines(line* ptr);
 paragraph* add_paragraph(paragraph* current_paragraph);
-void free_paragraphs(paragraph* ptr);
+void free_line(line* ptr);
+void free_paragraph(paragraph* ptr);
+void free_paragraph_buffers(paragraph* paragraphs);
+void* pool_alloc(pool* item_pool, size_t item_size);
+void pool_free(pool* item_pool, void* item);
+void pool_merge(pool* target_pool, pool* source_pool);
+void pool_release(pool* item_pool);
+paragraph* add_lazy_paragraph(paragraph* previous_paragraph, char* text, char* text_end, int source_paragraphs, int source_lines);
+void count_paragraphs(char* text, char* text_end, int* source_paragraphs, int* source_lines);
+paragraph* build_paragraph(paragraph* lazy_paragraph, int line_number, int source_index);
+int build_neighbours(paragraph* current_paragraph);
+int release_paragraphs(paragraph* current_paragraph, int whole_document);
+int release_paragraph(paragraph* built_paragraph);
+void forget_source(paragraph* edited_paragraph);
+int store_edit(paragraph* edited_paragraph);
+int add_span(piece_span* spans, int span_count, char* text, long length);
+char* piece_text(paragraph* lazy_paragraph, char** text_end);
+char* copy_paragraph_text(paragraph* built_paragraph, char* text);
+int rewrap_paragraph(paragraph* stale_paragraph, line** cursor_line);
+int last_line_number(paragraph* current_paragraph);
+
+// Line index functions
+void build_line_index(paragraph* paragraphs);
+void index_paragraph(paragraph* new_paragraph, paragraph* previous_paragraph);
+void unindex_paragraph(paragraph* old_paragraph);
+void rotate_up(paragraph* node);
+void count_tree_lines(paragraph* node);
+int count_lines(paragraph* current_paragraph);
+int first_line_number(paragraph* current_paragraph);
+paragraph* find_line(int line_number);
+
+// Packing functions
+int pack_paragraphs(paragraph* current_paragraph);
+int pack_run(paragraph* first_paragraph, paragraph* last_paragraph);
+int paragraph_cold(paragraph* built_paragraph, paragraph* current_paragraph);
+long paragraph_length(paragraph* built_paragraph);
+paragraph* unpack_paragraphs(paragraph* packed_paragraph, int line_number, int source_index);
+char* pack_scratch(long size);
+int pack_text(char* text, int length, char* packed);
+int pack_sequence(char* packed, int packed_size, char* literals, int literal_length, int offset, int match_length);
+int pack_length(char* packed, int packed_size, int length);
+void unpack_text(char* packed, int packed_size, char* text);
+
+// File functions
+paragraph* load_paragraphs(int read_file, paragraph* paragraphs);
+paragraph* build_paragraphs(paragraph* current_paragraph, char* text, char* text_end);
+void* build_chunk(void* argument);
+paragraph* index_paragraphs(int read_file, char* filename, paragraph* paragraphs);
+paragraph* read_index(struct stat* file_info, paragraph* current_paragraph, char* text);
+void write_index(struct stat* file_info, paragraph* paragraphs);
+void refresh_index(char* filename);
+void fill_index_header(index_header* header, struct stat* file_info);
+unsigned long long sample_hash(char* text, long long length);
+int start_follow(char* filename, paragraph* paragraphs);
+int follow_file(paragraph** cursor_paragraph, line** cursor_line);
+
+// Journal functions
+int open_journal(char* filename, paragraph** cursor_paragraph, line** cursor_line);
+int replay_journal(paragraph** cursor_paragraph, line** cursor_line);
+void journal_edit(int input, paragraph* current_paragraph, line* current_line);
+void rebase_journal(char* filename, long long snapshot_records);
+void close_journal(int remove_journal);
+void read_journal_header(char* filename, journal_header* header);
+void step_paragraph_index(int step);
+paragraph* seek_paragraph(paragraph* current_paragraph, int target_index);
+line* seek_offset(paragraph* current_paragraph, int offset);
+int paragraph_offset(line* current_line);
 
 //Display functions
-void print_lines(paragraph* paragraphs);
-void write_paragraphs(paragraph* paragraphs, FILE* write_file);
-void update_view(line* current_line);
-void update_cursor_position(line* current_line);
+void print_lines(void);
+void print_rows(line* paragraph_line, int first_line, int top, int bottom);
+void print_source(paragraph* lazy_paragraph, int first_line, int top, int bottom);
+void mark_rows(int first_row, int last_row);
+void draw_screen(void);
+int input_pending(void);
+void move_to(int row, int column);
+void scroll_rows(int shift);
+void clear_row(int row);
+void put_cell(char* text, int length, int width);
+int clear_screen(void);
+void flush_cells(void);
+void add_frame_text(char* text, int length);
+void add_frame_move(int row, int column);
+long long save_document(char* filename, paragraph* paragraphs, double* seconds, int* owner_lost);
+int start_background_save(char* filename, paragraph* paragraphs);
+void check_background_save(char* filename);
+long long document_size(paragraph* paragraphs);
+long long write_paragraphs(paragraph* paragraphs, FILE* write_file);
+void save_span(save_buffer* buffer, char* text, long length);
+void flush_save_buffer(save_buffer* buffer);
+void send_progress(long long done, long long total);
+void update_view(paragraph* current_paragraph, line* current_line);
+void update_cursor_position(paragraph* current_paragraph, line* current_line);
+void shift_view(int first_line, int difference);
 void fix_line_numbers(paragraph* current_paragraph);
+void print_status(void);
+
+// Each thread allocates from its own pools so the loader threads never contend for them
+__thread pool line_pool = {0};
+__thread pool paragraph_pool = {0};
+__thread pool buffer_pools[LINE_BUFFER_CLASSES] = {{0}};
 
 // These are used to track how many characters a line should be based on terminal size
 int max_x = 0;
 int max_y = 0;
 
+// The rows the document is drawn on, which leave the last one to the status unless the screen is a single row
+int view_rows = 0;
+
 // These are used to track the coordinates for the cursor
 int x = 0;
 int y = 0;
@@ -62,15 +396,157 @@ int up_fail_value = 0;
 int display_top = 0;
 int display_bottom = 0;
 
+// The rows of the document that have changed since they were drawn, and where the top of the view was then
+int dirty_top = INT_MAX;
+int dirty_bottom = -1;
+int drawn_top = -1;
+
+// The first line the last draw started from, which the next one walks from instead of the start of its paragraph
+paragraph* anchor_paragraph = NULL;
+line* anchor_line = NULL;
+
+// The root of the line index, which is built once the file is loaded and kept up to date from then on
+paragraph* line_index_root = NULL;
+int line_index_ready = 0;
+
+// Set by -l, leaves the file mapped and only builds the paragraphs that are looked at
+int lazy_loading = 0;
+char* file_map = NULL;
+off_t file_map_size = 0;
+
+// Set by -i, keeps the lazy block counts in an index file so reopening the file skips counting them
+int index_cache = 0;
+char* index_filename = NULL;
+int index_current = 0;
+
+// Set by -f, reads the file as it grows like tail -f and never writes it back
+int follow_mode = 0;
+int follow_read_file = -1;
+int follow_notify = -1;
+int follow_pending = 0;
+off_t follow_offset = 0;
+char* follow_buffer = NULL;
+paragraph* follow_paragraph = NULL;
+
+// Set by -p, gives each paragraph one gap buffer for all of its text and wraps it into rows only when it is drawn
+int paragraph_buffers = 0;
+
+// Set by -t, turns every paragraph away from the cursor back into a piece of text, either in the file or in the add buffer
+int piece_table = 0;
+
+// Edited paragraphs are copied whole onto the end of this when they become pieces, and nothing in it is freed or moved except the last copy, taken back when its paragraph is edited again
+pool add_buffer = {0};
+
+// Set by -m, the memory built lines and packed blocks can take before the coldest paragraphs are packed, with the file left mapped as in -l
+long long memory_budget = 0;
+__thread long long line_memory = 0;
+long long packed_memory = 0;
+int edit_clock = 0;
+
+// After a pass that found nothing cold enough to pack, the next one waits until memory use has grown past this
+long long pack_again = 0;
+
+// Text is gathered here to be packed and unpacked into it again
+char* scratch_text = NULL;
+long scratch_size = 0;
+
+// Set by -v, draws into a grid of cells and writes only the cells that differ from the last frame instead of going through curses
+int cell_renderer = 0;
+screen_cell* back_cells = NULL;
+screen_cell* front_cells = NULL;
+int cell_rows = 0;
+int cell_columns = 0;
+int cell_row = 0;
+int cell_column = 0;
+int cells_cleared = 0;
+int cells_scrolled = 0;
+
+// Each frame is put together here and handed to the terminal in one write, and where it left the terminal's cursor
+char* frame_text = NULL;
+long frame_used = 0;
+int terminal_row = -1;
+int terminal_column = -1;
+
+// Set by the first edit, after which a saved file no longer matches the index made when it was opened
+int document_edited = 0;
+
+// Tracks the save running in the background, and the message shown for it in the corner of the screen
+pid_t save_process = 0;
+int save_progress_pipe = -1;
+int save_progress_fd = -1;
+struct timespec save_start_time;
+char save_status[32] = "";
+long long save_journal_records = 0;
+
+// Edits are appended to the journal as they happen so a crash loses nothing that was typed
+char* journal_filename = NULL;
+int journal_file = -1;
+long long journal_records = 0;
+
+// Which paragraph of the document current_paragraph is, worked out the first time an edit is journaled
+int paragraph_index = -1;
+
 int main(int argc, char* argv[])
 {
-    char* filename = malloc(sizeof(char) * strlen(argv[1]) + 5);
+    int option;
+    while ((option = getopt(argc, argv, "lifptvm:")) != -1)
+    {
+        if (option == 'l')
+        {
+            lazy_loading = 1;
+        }
+        else if (option == 'i')
+        {
+            lazy_loading = 1;
+            index_cache = 1;
+        }
+        else if (option == 'f')
+        {
+            follow_mode = 1;
+        }
+        else if (option == 'p')
+        {
+            paragraph_buffers = 1;
+        }
+        else if (option == 't')
+        {
+            lazy_loading = 1;
+            piece_table = 1;
+        }
+        else if (option == 'v')
+        {
+            cell_renderer = 1;
+        }
+        else if (option == 'm' && atoll(optarg) > 0)
+        {
+            lazy_loading = 1;
+            memory_budget = atoll(optarg) << 20;
+        }
+        else
+        {
+            printf("Usage: %s [-l] [-i] [-f] [-p] [-t] [-v] [-m megabytes] filename\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        printf("Usage: %s [-l] [-i] [-f] [-p] [-t] [-v] [-m megabytes] filename\n", argv[0]);
+        return 1;
+    }
+
+    char* filename = malloc(sizeof(char) * strlen(argv[optind]) + 5);
     if (!filename)
     {
         printf("Filename malloc failed\n");
         return 1;
     }
-    sprintf(filename, "%s.txt", argv[1]);
+    sprintf(filename, "%s.txt", argv[optind]);
+
+    // Text is taken as UTF-8 whatever the environment's locale says, so the widths of characters come from a UTF-8 locale
+    if (setlocale(LC_CTYPE, "") == NULL || strcmp(nl_langinfo(CODESET), "UTF-8") != 0)
+    {
+        setlocale(LC_CTYPE, "C.UTF-8");
+    }
 
     initscr();
     cbreak();
@@ -78,9 +554,15 @@ int main(int argc, char* argv[])
     keypad(stdscr, true);
 
     getmaxyx(stdscr, max_y, max_x);
+    view_rows = (max_y > 1) ? max_y - 1 : 1;
+    if (cell_renderer && clear_screen() != 0)
+    {
+        printf("Screen allocation failed\n");
+        return 1;
+    }
 
-    // Setting the display value because coordinates are '0 indexed' so the final viewable line is actually max - 1
-    display_bottom = max_y - 1;
+    // Setting the display value because coordinates are '0 indexed' so the final viewable line is actually view_rows - 1
+    display_bottom = view_rows - 1;
 
     paragraph* paragraphs = add_paragraph(NULL);
     if (paragraphs == NULL)
@@ -92,83 +574,173 @@ int main(int argc, char* argv[])
     line* current_line = paragraphs->paragraph_start;
     paragraph* current_paragraph = paragraphs;
 
-    FILE* read_file = fopen(filename, "r+");
-    if (read_file != NULL)
+    // Follow mode reads the whole file through the same path as the text appended to it later
+    int read_file = (follow_mode) ? -1 : open(filename, O_RDONLY);
+    if (read_file != -1)
     {
-        char read_buffer;
         // Correctly building the data structure from existing data
-        while (fread(&read_buffer, 1, 1, read_file) != 0)
+        current_paragraph = (lazy_loading) ? index_paragraphs(read_file, filename, paragraphs) : load_paragraphs(read_file, paragraphs);
+        // Numbering the lines once the whole list is there, rather than as each loader thread makes it
+        if (current_paragraph != NULL)
         {
-            // Avoiding any new line characters making their way into the buffer as new lines are purely visual in Cursed
-            if (current_line->number_characters == max_x - 1)
-            {
-                current_line->next_line = add_line(current_line);
-                if (current_line->next_line == NULL)
-                {
-                    printf("Line allocation failed\n");
-                    return 1;
-                }
-                current_line->next_line->previous_line = current_line;
-                current_line = current_line->next_line;
-                current_paragraph->paragraph_end = current_line;
-
-                addat_cursor(read_buffer, current_line->previous_line);
-            }
-            else if (read_buffer != '\n')
-            {
-                addat_cursor(read_buffer, current_line);
-            }
-            // Preserving the structure of each 'line' in the original file
-            else if (read_buffer == '\n')
-            {
-                current_paragraph->next_paragraph = add_paragraph(current_paragraph);
-                if (current_paragraph->next_paragraph == NULL)
-                {
-                    printf("Paragraph allocation failed\n");
-                    return 1;
-                }
-                current_paragraph->paragraph_end = current_line;
-                current_paragraph = current_paragraph->next_paragraph;
-                current_line = current_paragraph->paragraph_start;
-            }
+            build_line_index(paragraphs);
+        }
+        if (current_paragraph != NULL && current_paragraph->paragraph_start == NULL)
+        {
+            current_paragraph = build_paragraph(current_paragraph, last_line_number(current_paragraph), INT_MAX);
         }
-        update_view(current_line);
-        print_lines(paragraphs);
-        
-        getyx(stdscr, y, x);
-        // Doing this routine to set the cursor correctly because printw will advance it to the next line
-        if (current_line->line_number < max_y - 1)
+        if (current_paragraph == NULL)
         {
-            y--;
+            printf("File load failed\n");
+            return 1;
         }
-        x = current_line->number_characters;
-        move(y, x);
+        current_line = current_paragraph->paragraph_end;
+        close(read_file);
+    }
+    else
+    {
+        // A new document or one being followed starts with just the first paragraph
+        build_line_index(paragraphs);
+    }
+
+    // Putting back any edits a crashed session left in the journal
+    if (!follow_mode && open_journal(filename, &current_paragraph, &current_line) != 0)
+    {
+        printf("Journal replay failed\n");
+        return 1;
+    }
+
+    if (follow_mode && (start_follow(filename, paragraphs) != 0 || follow_file(&current_paragraph, &current_line) == -1))
+    {
+        printf("Could not follow %s\n", filename);
+        return 1;
+    }
+
+    // Whatever loading and the journal built away from the cursor goes back to being pieces
+    if (piece_table && release_paragraphs(current_paragraph, 1) != 0)
+    {
+        printf("Add buffer allocation failed\n");
+        return 1;
+    }
 
-        refresh();
-        fclose(read_file);
+    update_view(current_paragraph, current_line);
+    if (memory_budget > 0 && pack_paragraphs(current_paragraph) != 0)
+    {
+        printf("Packed block allocation failed\n");
+        return 1;
     }
+    update_cursor_position(current_paragraph, current_line);
+    draw_screen();
 
     int input;
     while ((input = getch()) != KEY_F(1))
     {
+        // Terminals whose backspace key is set in terminfo hand it over as KEY_BACKSPACE instead of DEL
+        if (input == KEY_BACKSPACE)
+        {
+            input = 127;
+        }
+
+        // Any paragraph the cursor can step into needs its lines first
+        if (build_neighbours(current_paragraph) != 0)
+        {
+            printf("Paragraph allocation failed\n");
+            return 1;
+        }
+        if (piece_table && release_paragraphs(current_paragraph, 0) != 0)
+        {
+            printf("Add buffer allocation failed\n");
+            return 1;
+        }
+        if (memory_budget > 0 && pack_paragraphs(current_paragraph) != 0)
+        {
+            printf("Packed block allocation failed\n");
+            return 1;
+        }
+
+        // Taking in whatever has been appended to the file since the last look
+        if (follow_mode)
+        {
+            // New text only ever changes the last paragraph and adds rows after it
+            int follow_row = first_line_number(follow_paragraph);
+            int followed = follow_file(&current_paragraph, &current_line);
+            if (followed == -1)
+            {
+                printf("Follow read failed\n");
+                return 1;
+            }
+            if (followed == 1)
+            {
+                mark_rows(follow_row, INT_MAX);
+            }
+        }
+
+        // Picking up progress from a background save, and dropping the last message once a key is pressed
+        if (save_process != 0)
+        {
+            check_background_save(filename);
+        }
+        else if (input != ERR)
+        {
+            save_status[0] = '\0';
+        }
+
         if (input == KEY_F(1))
         {
             break;
         }
+        // The paragraphs on screen are wrapped to the new size as they are drawn, and the rest only when they are next needed
+        else if (input == KEY_RESIZE)
+        {
+            getmaxyx(stdscr, max_y, max_x);
+            view_rows = (max_y > 1) ? max_y - 1 : 1;
+            display_bottom = display_top + view_rows - 1;
+            if (rewrap_paragraph(current_paragraph, &current_line) != 0 || build_neighbours(current_paragraph) != 0)
+            {
+                printf("Line allocation failed\n");
+                return 1;
+            }
+
+            // Everything from the top of the view down to the cursor is wrapped now, so the cursor's row is worked out from the new widths
+            for (paragraph* para_ptr = find_line(display_top); para_ptr != NULL && para_ptr != current_paragraph; para_ptr = para_ptr->next_paragraph)
+            {
+                if (rewrap_paragraph(para_ptr, NULL) != 0)
+                {
+                    printf("Line allocation failed\n");
+                    return 1;
+                }
+            }
+            up_fail_value = 0;
+            down_fail_value = 0;
+            if (clear_screen() != 0)
+            {
+                printf("Screen allocation failed\n");
+                return 1;
+            }
+            mark_rows(0, INT_MAX);
+        }
+        else if (input == KEY_F(2) && !follow_mode)
+        {
+            if (save_process == 0 && start_background_save(filename, paragraphs) != 0)
+            {
+                snprintf(save_status, sizeof(save_status), "%24s", "Save failed");
+            }
+        }
         else if (input == KEY_LEFT)
         {
             if (current_line->gap_start == current_line->buffer && current_line->previous_line == NULL && current_paragraph->previous_paragraph != NULL)
             {
                 current_paragraph = current_paragraph->previous_paragraph;
+                step_paragraph_index(-1);
                 current_line = current_paragraph->paragraph_end;
                 move_cursor_to(current_line, current_line->number_characters);
             }
-            // If at the start of the line and there is a previous line
+            // The end of a wrapped line is the start of the next, so the cursor goes back before its last character
             else if (current_line->gap_start == current_line->buffer && current_line->previous_line != NULL)
             {
                 current_line = current_line->previous_line;
-                int destination = (current_line->number_characters == max_x) ? max_x - 1 : current_line->number_characters;
-                move_cursor_to(current_line, destination);
+                int width;
+                move_cursor_to(current_line, current_line->number_characters - character_before(current_line, current_line->number_characters, &width));
             }
             // If you're anywhere else in the line
             else if (current_line->gap_start != current_line->buffer)
@@ -177,24 +749,22 @@ int main(int argc, char* argv[])
             }
             up_fail_value = 0;
             down_fail_value = 0;
-            clear();
-            update_view(current_line);
-            update_cursor_position(current_line);
-            print_lines(paragraphs);
-            move(y, x);
-            refresh();
         }
         else if (input == KEY_RIGHT)
         {
+            int cursor_offset = current_line->gap_start - current_line->buffer;
+            int width;
             // If at the end of the line and the next line already exists
             // TO DO
             if (current_line->gap_start == current_line->buffer + current_line->number_characters && current_line->next_line == NULL && current_paragraph->next_paragraph != NULL)
             {
                 current_paragraph = current_paragraph->next_paragraph;
+                step_paragraph_index(1);
                 current_line = current_paragraph->paragraph_start;
                 move_cursor_to(current_line, 0);
             }
-            else if (current_line->gap_start == current_line->buffer_end && current_line->next_line != NULL)
+            // Stepping over the last character of a wrapped line lands on the start of the next
+            else if (current_line->next_line != NULL && cursor_offset < current_line->number_characters && cursor_offset + character_after(current_line, cursor_offset, &width) == current_line->number_characters)
             {
                 current_line = current_line->next_line;
                 move_cursor_to(current_line, 0);
@@ -206,25 +776,29 @@ int main(int argc, char* argv[])
             }
             up_fail_value = 0;
             down_fail_value = 0;
-            clear();
-            update_view(current_line);
-            update_cursor_position(current_line);
-            print_lines(paragraphs);
-            move(y, x);
-            refresh();
         }
         else if (input == KEY_UP)
         {
-            int destination = current_line->gap_start - current_line->buffer;
-            if (current_line->previous_line == NULL && current_paragraph->previous_paragraph != NULL)
+            // A paragraph buffer holds every row of its paragraph, so the column is worked out within the cursor's row
+            int cursor_offset = current_line->gap_start - current_line->buffer;
+            int cursor_row;
+            int start = row_start(current_line, cursor_offset, &cursor_row);
+            int destination = row_column(current_line, start, cursor_offset);
+            if (current_line->previous_line == NULL && start == 0 && current_paragraph->previous_paragraph != NULL)
             {
                 current_paragraph = current_paragraph->previous_paragraph;
+                step_paragraph_index(-1);
                 current_line = current_paragraph->paragraph_end; 
+
+                // The last row is the whole of the last line unless it is a paragraph buffer
+                int last_row;
+                int last_start = row_start(current_line, current_line->number_characters, &last_row);
+                int row_length = row_column(current_line, last_start, current_line->number_characters);
                 if (up_fail_value > 0)
                 {
-                    if (current_line->number_characters >= up_fail_value)
+                    if (row_length >= up_fail_value)
                     {
-                        move_cursor_to(current_line, up_fail_value);
+                        move_cursor_to(current_line, column_offset(current_line, last_start, up_fail_value));
                         up_fail_value = 0;
                     }
                     else
@@ -232,9 +806,9 @@ int main(int argc, char* argv[])
                         move_cursor_to(current_line, current_line->number_characters);
                     }
                 }
-                else if (current_line->number_characters >= destination)
+                else if (row_length >= destination)
                 {
-                    move_cursor_to(current_line, destination);
+                    move_cursor_to(current_line, column_offset(current_line, last_start, destination));
                 }
                 else
                 {
@@ -245,391 +819,409 @@ int main(int argc, char* argv[])
             else if (current_line->previous_line != NULL)
             {
                 current_line = current_line->previous_line;
-                move_cursor_to(current_line, destination);
+                move_cursor_to(current_line, column_offset(current_line, 0, destination));
+            }
+            else if (start > 0)
+            {
+                int previous_row;
+                move_cursor_to(current_line, column_offset(current_line, row_start(current_line, start - 1, &previous_row), destination));
             }
-            clear();
-            update_view(current_line);
-            update_cursor_position(current_line);
-            print_lines(paragraphs);
-            move(y, x);
-            refresh();
         }
         else if (input == KEY_DOWN)
         {
-            int destination = current_line->gap_start - current_line->buffer;
-            if (current_line->next_line == NULL && current_paragraph->next_paragraph != NULL)
+            int cursor_offset = current_line->gap_start - current_line->buffer;
+            int cursor_row;
+            int start = row_start(current_line, cursor_offset, &cursor_row);
+            int destination = row_column(current_line, start, cursor_offset);
+            int last_row;
+            int last_start = row_start(current_line, current_line->number_characters, &last_row);
+            if (current_line->next_line == NULL && start == last_start && current_paragraph->next_paragraph != NULL)
             {
                 current_paragraph = current_paragraph->next_paragraph;
+                step_paragraph_index(1);
                 current_line = current_paragraph->paragraph_start;
 
+                int row_end_offset = row_last(current_line, 0);
+                int row_length = row_column(current_line, 0, row_end_offset);
                 if (down_fail_value > 0)
                 {
-                    if (current_line->number_characters >= down_fail_value)
+                    if (row_length >= down_fail_value)
                     {
-                        move_cursor_to(current_line, down_fail_value);
+                        move_cursor_to(current_line, column_offset(current_line, 0, down_fail_value));
                         down_fail_value = 0;
                     }
                     else
                     {
-                        move_cursor_to(current_line, current_line->number_characters);
+                        move_cursor_to(current_line, row_end_offset);
                     }
                 }
-                else if (current_line->number_characters >= destination)
+                else if (row_length >= destination)
                 {
-                    move_cursor_to(current_line, destination);
+                    move_cursor_to(current_line, column_offset(current_line, 0, destination));
                 }
                 else
                 {
                     down_fail_value = destination;
-                    move_cursor_to(current_line, current_line->number_characters);
+                    move_cursor_to(current_line, row_end_offset);
                 }
             }
             else if (current_line->next_line != NULL)
             {
                 current_line = current_line->next_line;
-                destination = (current_line->number_characters >= destination) ? destination : current_line->number_characters;
-                move_cursor_to(current_line, destination);
+                move_cursor_to(current_line, column_offset(current_line, 0, destination));
+            }
+            else if (start < last_start)
+            {
+                int width;
+                move_cursor_to(current_line, column_offset(current_line, row_end(current_line, start, max_x, &width), destination));
             }
-            clear();
-            update_view(current_line);
-            update_cursor_position(current_line);
-            print_lines(paragraphs);
-            move(y, x);
-            refresh();
         }
-        else if (input == 127)
+        else if (!follow_mode && input >= 0 && input <= 0xff)
         {
-            if (current_line->gap_start == current_line->buffer && current_line->number_characters > 0 && current_line->previous_line == NULL && current_paragraph->previous_paragraph != NULL)
-            {
-                paragraph* original_current = current_paragraph;
-
-                copy_lines(current_line, current_paragraph->previous_paragraph);
+            // An edit changes the rows from two above the cursor to the end of its paragraph, and every row below if it changes how many there are
+            // Backspace at the start of a row takes the character ending the row above, and a row ends where the next character no longer fits, so the row before that one can take more or less text too
+            int first_row = display_top + y - 2;
+            int document_lines = line_index_root->tree_lines;
 
-                current_paragraph = current_paragraph->previous_paragraph;
-                current_line = current_paragraph->paragraph_end;
-
-                current_paragraph->next_paragraph = original_current->next_paragraph;
-                if (current_paragraph->next_paragraph != NULL)
+            // A byte past ASCII starts a UTF-8 character, which is edited in whole once the rest of it is read
+            int character = (input >= 0x80) ? read_character(input) : input;
+            if (character != -1)
+            {
+                journal_edit(character, current_paragraph, current_line);
+                if (edit_at_cursor(character, &current_paragraph, &current_line) != 0)
                 {
-                    current_paragraph->next_paragraph->previous_paragraph = current_paragraph;
+                    return 1;
                 }
-                free_lines(original_current->paragraph_start);
-                free(original_current);
-                fix_line_numbers(current_paragraph);
             }
-            else if (current_line->number_characters == 0 && current_line->previous_line == NULL && current_paragraph->previous_paragraph != NULL)
-            {
-                paragraph* empty_paragraph = current_paragraph;
+            int last_row = (line_index_root->tree_lines == document_lines) ? first_line_number(current_paragraph) + count_lines(current_paragraph) - 1 : INT_MAX;
+            mark_rows(first_row, last_row);
+        }
 
-                current_paragraph = current_paragraph->previous_paragraph;
-                current_line = current_paragraph->paragraph_end;
+        // Every pass ends in a draw, even for a key nothing handles, so one that came last in a burst still shows what the keys before it did
+        update_view(current_paragraph, current_line);
+        update_cursor_position(current_paragraph, current_line);
+        draw_screen();
+    }
+    endwin();
+    free(back_cells);
+    free(front_cells);
+    free(frame_text);
 
-                int destination = (current_line->number_characters == max_x) ? max_x - 1 : current_line->number_characters;
-                move_cursor_to(current_line, destination);
+    // The file being followed belongs to whatever is writing it
+    if (follow_mode)
+    {
+        close(follow_read_file);
+        close(follow_notify);
+        free(follow_buffer);
+        free(filename);
+        free_paragraph_buffers(paragraphs);
+        pool_release(&line_pool);
+        pool_release(&paragraph_pool);
+        for (int i = 0; i < LINE_BUFFER_CLASSES; i++)
+        {
+            pool_release(&buffer_pools[i]);
+        }
+        pool_release(&add_buffer);
+        return 0;
+    }
 
-                current_paragraph->next_paragraph = empty_paragraph->next_paragraph;
-                if (current_paragraph->next_paragraph != NULL)
-                {
-                    current_paragraph->next_paragraph->previous_paragraph = current_paragraph;
-                    fix_line_numbers(current_paragraph);
-                }
-                free(empty_paragraph->paragraph_start->buffer);
-                free(empty_paragraph->paragraph_start);
-                free(empty_paragraph);
-            }
-            else if (current_line->number_characters == 0 && current_line->previous_line != NULL)
-            {
-                line* empty_line = current_line;
+    // Letting an in-session save finish before the final one replaces the file
+    if (save_process != 0)
+    {
+        waitpid(save_process, NULL, 0);
+    }
 
-                current_line = current_line->previous_line;
+    double save_seconds = 0;
+    int owner_lost = 0;
+    long long saved_bytes = save_document(filename, paragraphs, &save_seconds, &owner_lost);
+    if (saved_bytes == -1)
+    {
+        printf("File write failed, %s was left as it was\n", filename);
+        return 1;
+    }
+    printf("Saved %lld bytes to %s in %.1f ms (%.1f MB/s)\n", saved_bytes, filename, save_seconds * 1000, (save_seconds > 0) ? saved_bytes / save_seconds / 1000000 : 0);
+    if (owner_lost)
+    {
+        printf("%s could not be given back to its owner and now belongs to you%s\n", filename, (owner_lost == 2) ? " and your group" : "");
+    }
 
-                int destination = (current_line->number_characters == max_x) ? max_x - 1 : current_line->number_characters;
-                move_cursor_to(current_line, destination);
-                current_line->number_characters--;
+    // Everything in the journal is in the file now
+    close_journal(1);
+    refresh_index(filename);
+    free(index_filename);
+    free(filename);
 
-                current_line->next_line = empty_line->next_line;
-                if (current_line->next_line != NULL)
-                {
-                    current_line->next_line->previous_line = current_line;
-                    fix_line_numbers(current_paragraph);
-                }
-                free(empty_line->buffer);
-                free(empty_line);
-            }
-            else if (current_line->number_characters == max_x && current_line->next_line != NULL)
-            {
-                int move_size = current_line->buffer_end - current_line->gap_start + 1;
-                current_line->gap_start--;
-                current_line->gap_end--;
-                memmove(current_line->gap_start, current_line->gap_start + 1, move_size);
-                
-                shuffle_start(current_paragraph, current_line);
+    // Every line and paragraph lives in the pools, so handing back their slabs frees the whole document at once
+    free_paragraph_buffers(paragraphs);
+    pool_release(&line_pool);
+    pool_release(&paragraph_pool);
+    for (int i = 0; i < LINE_BUFFER_CLASSES; i++)
+    {
+        pool_release(&buffer_pools[i]);
+    }
+    pool_release(&add_buffer);
+    if (file_map != NULL)
+    {
+        munmap(file_map, file_map_size);
+    }
+    return 0;
+}
 
-                if (current_paragraph->paragraph_end->number_characters == 0)
-                {
-                    current_paragraph->paragraph_end = current_paragraph->paragraph_end->previous_line;
-                    free_lines(current_paragraph->paragraph_end->next_line);
-                    current_paragraph->paragraph_end->next_line = NULL;
-                    fix_line_numbers(current_paragraph);
-                }
+int edit_at_cursor(int input, paragraph** cursor_paragraph, line** cursor_line)
+{
+    paragraph* current_paragraph = *cursor_paragraph;
+    line* current_line = *cursor_line;
+    document_edited = 1;
+
+    forget_source(current_paragraph);
+    current_paragraph->last_edit = ++edit_clock;
+
+    if (input == 127)
+    {
+        if (current_line->gap_start == current_line->buffer && current_line->number_characters > 0 && current_line->previous_line == NULL && current_paragraph->previous_paragraph != NULL)
+        {
+            paragraph* original_current = current_paragraph;
+
+            if (copy_lines(current_line, current_paragraph->previous_paragraph) == NULL)
+            {
+                printf("Line allocation failed\n");
+                return 1;
             }
-            else
+
+            current_paragraph = current_paragraph->previous_paragraph;
+            step_paragraph_index(-1);
+            current_line = current_paragraph->paragraph_end;
+
+            current_paragraph->next_paragraph = original_current->next_paragraph;
+            if (current_paragraph->next_paragraph != NULL)
             {
-                delete(current_line);
+                current_paragraph->next_paragraph->previous_paragraph = current_paragraph;
             }
-            clear();
-            update_view(current_line);
-            update_cursor_position(current_line);
-            print_lines(paragraphs);
-            move(y, x);
-            refresh();
+            free_lines(original_current->paragraph_start);
+            free_paragraph(original_current);
+            fix_line_numbers(current_paragraph);
         }
-        else if (input == 10)
+        else if (current_line->number_characters == 0 && current_line->previous_line == NULL && current_paragraph->previous_paragraph != NULL)
         {
-            if (current_line->gap_start == current_line->buffer + current_line->number_characters)
-            {
-                if (current_paragraph->next_paragraph == NULL)
-                {
-                    current_paragraph->paragraph_end = current_line;
-                    current_paragraph->next_paragraph = add_paragraph(current_paragraph);
-                    if (current_paragraph->next_paragraph == NULL)
-                    {
-                        printf("Paragraph allocation failed\n");
-                        return 1;
-                    }
-                
-                    current_paragraph = current_paragraph->next_paragraph;
-                    current_line = current_paragraph->paragraph_start;
-                }
-                else if (current_paragraph->next_paragraph != NULL)
-                {
-                    paragraph* original_next = current_paragraph->next_paragraph;
+            paragraph* empty_paragraph = current_paragraph;
 
-                    current_paragraph->paragraph_end = current_line;
-                    current_paragraph->next_paragraph = add_paragraph(current_paragraph);
-                    if (current_paragraph->next_paragraph == NULL)
-                    {
-                        printf("Paragraph allocation failed\n");
-                        return 1;
-                    }                
-                    current_paragraph = current_paragraph->next_paragraph;
-                    current_paragraph->next_paragraph = original_next;
-                    original_next->previous_paragraph = current_paragraph;
-                    current_line = current_paragraph->paragraph_start;
-                    fix_line_numbers(current_paragraph);
-                }
+            current_paragraph = current_paragraph->previous_paragraph;
+            step_paragraph_index(-1);
+            current_line = current_paragraph->paragraph_end;
+
+            move_cursor_to(current_line, current_line->number_characters);
+
+            current_paragraph->next_paragraph = empty_paragraph->next_paragraph;
+            if (current_paragraph->next_paragraph != NULL)
+            {
+                current_paragraph->next_paragraph->previous_paragraph = current_paragraph;
+                fix_line_numbers(current_paragraph);
             }
-            else
+            free_line(empty_paragraph->paragraph_start);
+            free_paragraph(empty_paragraph);
+        }
+        // A paragraph buffer is the whole paragraph, so deleting only changes how many rows it wraps to
+        else if (paragraph_buffers)
+        {
+            delete(current_line);
+            fix_line_numbers(current_paragraph);
+        }
+        else
+        {
+            // At the start of a wrapped line the character to go is the last one on the line above
+            if (current_line->gap_start == current_line->buffer && current_line->previous_line != NULL)
+            {
+                current_line = current_line->previous_line;
+                move_cursor_to(current_line, current_line->number_characters);
+            }
+            delete(current_line);
+            if (wrap_lines(current_paragraph, current_line, &current_line) != 0)
             {
+                printf("Line allocation failed\n");
+                return 1;
+            }
+        }
+    }
+    else if (input == 10)
+    {
+        if (current_line->gap_start == current_line->buffer + current_line->number_characters)
+        {
+            if (current_paragraph->next_paragraph == NULL)
+            {
+                current_paragraph->paragraph_end = current_line;
+                current_paragraph->next_paragraph = add_paragraph(current_paragraph);
                 if (current_paragraph->next_paragraph == NULL)
                 {
-                    current_paragraph->paragraph_end = current_line;
-                    current_paragraph->next_paragraph = add_paragraph(current_paragraph);
-                    if (current_paragraph->next_paragraph == NULL)
-                    {
-                        printf("Paragraph allocation failed\n");
-                        return 1;
-                    }                
-                    copy_lines(current_line, current_paragraph->next_paragraph);
-                    current_line->number_characters = current_line->gap_start - current_line->buffer;
-                    current_line->gap_end = current_line->buffer_end;
-
-                    free_lines(current_line->next_line);
-                    current_line->next_line = NULL;
-
-                    current_paragraph = current_paragraph->next_paragraph;
-                    current_line = current_paragraph->paragraph_start;
-
-                    fix_line_numbers(current_paragraph);
+                    printf("Paragraph allocation failed\n");
+                    return 1;
                 }
-                else if (current_paragraph->next_paragraph != NULL)
-                {
-                    paragraph* original_next = current_paragraph->next_paragraph;
+            
+                current_paragraph = current_paragraph->next_paragraph;
+                step_paragraph_index(1);
+                current_line = current_paragraph->paragraph_start;
+            }
+            else if (current_paragraph->next_paragraph != NULL)
+            {
+                paragraph* original_next = current_paragraph->next_paragraph;
 
-                    current_paragraph->paragraph_end = current_line;
-                    current_paragraph->next_paragraph = add_paragraph(current_paragraph);
-                    if (current_paragraph->next_paragraph == NULL)
-                    {
-                        printf("Paragraph allocation failed\n");
-                        return 1;
-                    }
-                    copy_lines(current_line, current_paragraph->next_paragraph);
-                    current_line->number_characters = current_line->gap_start - current_line->buffer;
-                    current_line->gap_end = current_line->buffer_end;
-
-                    free_lines(current_line->next_line);
-                    current_line->next_line = NULL;
-                    
-                    current_paragraph = current_paragraph->next_paragraph;
-                    current_paragraph->next_paragraph = original_next;
-                    original_next->previous_paragraph = current_paragraph;
-                    
-                    current_line = current_paragraph->paragraph_start;
-                    fix_line_numbers(current_paragraph);
-                }
+                current_paragraph->paragraph_end = current_line;
+                current_paragraph->next_paragraph = add_paragraph(current_paragraph);
+                if (current_paragraph->next_paragraph == NULL)
+                {
+                    printf("Paragraph allocation failed\n");
+                    return 1;
+                }                
+                current_paragraph = current_paragraph->next_paragraph;
+                step_paragraph_index(1);
+                current_paragraph->next_paragraph = original_next;
+                original_next->previous_paragraph = current_paragraph;
+                current_line = current_paragraph->paragraph_start;
+                fix_line_numbers(current_paragraph);
             }
-        clear();
-        update_view(current_line);
-        update_cursor_position(current_line);
-        print_lines(paragraphs);
-        move(y, x);
-        refresh();
         }
-        // Buffer insertion
-        else if (input >= 0 && input <= 126)
+        else
         {
-            // If line is full and there's not a next line yet, make a new line
-            if (current_line->number_characters == max_x - 1 && current_line->next_line == NULL)
+            if (current_paragraph->next_paragraph == NULL)
             {
-                if (current_line->gap_start == current_line->buffer_end)
+                current_paragraph->paragraph_end = current_line;
+                current_paragraph->next_paragraph = add_paragraph(current_paragraph);
+                if (current_paragraph->next_paragraph == NULL)
                 {
-                    addat_cursor(input, current_line);
-                    current_line->next_line = add_line(current_line);
-                    if (current_line->next_line == NULL)
-                    {
-                        printf("Line allocation failed\n");
-                        return 1;
-                    }
-                    current_line = current_line->next_line;
-                    current_paragraph->paragraph_end = current_line;
-                }
-                else
+                    printf("Paragraph allocation failed\n");
+                    return 1;
+                }                
+                if (copy_lines(current_line, current_paragraph->next_paragraph) == NULL)
                 {
-                    addat_cursor(input, current_line);
-                    current_line->next_line = add_line(current_line);
-                    if (current_line->next_line == NULL)
-                    {
-                        printf("Line allocation failed\n");
-                        return 1;
-                    }
-                    current_paragraph->paragraph_end = current_line->next_line;
+                    printf("Line allocation failed\n");
+                    return 1;
                 }
+                int moved = current_line->buffer_end - current_line->gap_end;
+                current_line->number_characters = current_line->gap_start - current_line->buffer;
+                current_line->width = text_width(current_line->buffer, current_line->gap_start);
+                current_line->gap_end = current_line->buffer_end;
+                refit_rows(current_line, current_line->number_characters, moved, 0);
 
-                if (current_paragraph->next_paragraph != NULL)
+                free_lines(current_line->next_line);
+                current_line->next_line = NULL;
+                if (!paragraph_buffers && wrap_lines(current_paragraph, current_line, &current_line) != 0)
                 {
-                    fix_line_numbers(current_paragraph->next_paragraph);
+                    printf("Line allocation failed\n");
+                    return 1;
                 }
+
+                current_paragraph = current_paragraph->next_paragraph;
+                step_paragraph_index(1);
+                current_line = current_paragraph->paragraph_start;
+
+                fix_line_numbers(current_paragraph);
             }
-            else if (current_line->number_characters == max_x && current_line->next_line != NULL)
+            else if (current_paragraph->next_paragraph != NULL)
             {
-                if (current_line->gap_start == current_line->buffer_end)
+                paragraph* original_next = current_paragraph->next_paragraph;
+
+                current_paragraph->paragraph_end = current_line;
+                current_paragraph->next_paragraph = add_paragraph(current_paragraph);
+                if (current_paragraph->next_paragraph == NULL)
                 {
-                    shuffle_end(current_paragraph, current_line, 1);
-                    addat_cursor(input, current_line);
-                    current_line = current_line->next_line;
-                    current_line->gap_start = current_line->buffer;
+                    printf("Paragraph allocation failed\n");
+                    return 1;
                 }
-                else
+                if (copy_lines(current_line, current_paragraph->next_paragraph) == NULL)
                 {
-                    shuffle_end(current_paragraph, current_line, 1);
-                    memmove(current_line->gap_start + 1, current_line->gap_start, current_line->buffer_end - current_line->gap_start);
-                    addat_cursor(input, current_line);
-                    current_line->gap_end = current_line->gap_start;
+                    printf("Line allocation failed\n");
+                    return 1;
                 }
+                int moved = current_line->buffer_end - current_line->gap_end;
+                current_line->number_characters = current_line->gap_start - current_line->buffer;
+                current_line->width = text_width(current_line->buffer, current_line->gap_start);
+                current_line->gap_end = current_line->buffer_end;
+                refit_rows(current_line, current_line->number_characters, moved, 0);
 
-                if (current_paragraph->next_paragraph != NULL)
+                free_lines(current_line->next_line);
+                current_line->next_line = NULL;
+                if (!paragraph_buffers && wrap_lines(current_paragraph, current_line, &current_line) != 0)
                 {
-                    fix_line_numbers(current_paragraph->next_paragraph);
+                    printf("Line allocation failed\n");
+                    return 1;
                 }
+                
+                current_paragraph = current_paragraph->next_paragraph;
+                step_paragraph_index(1);
+                current_paragraph->next_paragraph = original_next;
+                original_next->previous_paragraph = current_paragraph;
+                
+                current_line = current_paragraph->paragraph_start;
+                fix_line_numbers(current_paragraph);
             }
-            else
-            {
-                addat_cursor(input, current_line);
-            }
-        clear();
-        update_cursor_position(current_line);
-        update_view(current_line);
-        print_lines(paragraphs);
-        move(y, x);
-        refresh();
+
+            // The cursor goes to the end of the new paragraph's first row
+            move_cursor_to(current_line, row_last(current_line, 0));
         }
-    }
-    endwin();
 
-    FILE* write_file = fopen(filename, "w+");
-    if (write_file == NULL)
-    {
-        printf("File open failed\n");
-        return 1;
+        // The paragraph the cursor left may have lost lines to the new one
+        fix_line_numbers(current_paragraph->previous_paragraph);
     }
-    int i = 0;
-    for (char* ptr = current_line->buffer; ptr <= current_line->buffer_end; ptr++)
+    // Buffer insertion
+    else
     {
-        if (ptr < current_line->gap_start || ptr > current_line->gap_end)
+        // Room for the longest UTF-8 character, so the gap never closes up
+        if (grow_line(current_line, current_line->number_characters + 5) != 0)
         {
-            i++;
+            printf("Line buffer allocation failed\n");
+            return 1;
+        }
+        addat_cursor(input, current_line);
+
+        // A paragraph buffer grows instead of wrapping onto a new line, so at most the paragraphs after it move down
+        if (paragraph_buffers)
+        {
+            fix_line_numbers(current_paragraph);
+        }
+        else if (wrap_lines(current_paragraph, current_line, &current_line) != 0)
+        {
+            printf("Line allocation failed\n");
+            return 1;
         }
     }
-    write_paragraphs(paragraphs, write_file);
-    fclose(write_file);
-    free(filename);
-    free_paragraphs(paragraphs);
+
+    // Merging edits the paragraph before, and a split leaves the cursor in a new one
+    forget_source(current_paragraph);
+    current_paragraph->last_edit = edit_clock;
+
+    *cursor_paragraph = current_paragraph;
+    *cursor_line = current_line;
     return 0;
 }
 
 void addat_cursor(int input, line* current_line)
 {
-    if (current_line->number_characters < max_x)
-    {
-        *current_line->gap_start = input;
-        current_line->number_characters++;
-
-        if (current_line->gap_start != current_line->buffer_end)
-        {
-            current_line->gap_start++;
-        }        
-    }
-    else
-    {
-        *current_line->gap_start = input;
-
-        if (current_line->gap_start != current_line->buffer_end)
-        {
-            current_line->gap_start++;
-        }        
-    }
+    // The character goes in as UTF-8, into a line grown beforehand so the gap still has a byte to spare after it
+    int length = encode_character(input, current_line->gap_start);
+    current_line->gap_start += length;
+    current_line->number_characters += length;
+    current_line->width += character_width(input);
+    refit_rows(current_line, current_line->gap_start - current_line->buffer - length, 0, length);
 }
 
 void move_left_one(line* current_line)
 {
-    if (current_line->number_characters == max_x)
-    {
-        current_line->gap_start--;
-        current_line->gap_end--;     
-    }
-    else
-    {
-        current_line->gap_start--;
-        *current_line->gap_end = *current_line->gap_start;
-        current_line->gap_end--;     
-    }
+    int width;
+    int offset = current_line->gap_start - current_line->buffer;
+    move_cursor_to(current_line, offset - character_before(current_line, offset, &width));
 }
 
 void move_right_one(line* current_line)
 {
-    if (current_line->number_characters == max_x)
-    {
-        current_line->gap_start++;
-        current_line->gap_end++;     
-    }
-    else
-    {
-        current_line->gap_end++; 
-        *current_line->gap_start = *current_line->gap_end;
-        current_line->gap_start++;
-    }
+    int width;
+    int offset = current_line->gap_start - current_line->buffer;
+    move_cursor_to(current_line, offset + character_after(current_line, offset, &width));
 }
 
 void move_cursor_to(line* line, int destination)
 {
     int current_position = line->gap_start - line->buffer;
 
-    if (line->number_characters == max_x)
-    {
-        line->gap_start = line->buffer + destination;
-        line->gap_end = line->buffer + destination;
-    }
-    else if (current_position < destination)
+    if (current_position < destination)
     {
         int move_size = destination - current_position;
         memmove(line->gap_start, line->gap_end + 1, move_size);
@@ -651,22 +1243,83 @@ void move_cursor_to(line* line, int destination)
 
 void delete(line* current_line)
 {
-    if (current_line->number_characters == max_x && current_line->gap_start != current_line->buffer)
+    if (current_line->gap_start != current_line->buffer)
+    {
+        int width;
+        int length = character_before(current_line, current_line->gap_start - current_line->buffer, &width);
+        current_line->gap_start -= length;
+        current_line->number_characters -= length;
+        current_line->width -= width;
+        refit_rows(current_line, current_line->gap_start - current_line->buffer, length, 0);
+    }
+}
+
+int grow_line(line* current_line, int capacity)
+{
+    int old_capacity = current_line->buffer_end - current_line->buffer + 1;
+    if (old_capacity >= capacity)
+    {
+        return 0;
+    }
+    // Doubling keeps typing into a growing paragraph at a constant cost per character
+    if (capacity < old_capacity * 2)
+    {
+        capacity = old_capacity * 2;
+    }
+
+    int gap_offset = current_line->gap_start - current_line->buffer;
+    int after_gap = current_line->buffer_end - current_line->gap_end;
+    char* buffer;
+    if (paragraph_buffers)
+    {
+        buffer = realloc(current_line->buffer, capacity);
+        if (buffer == NULL)
+        {
+            return 1;
+        }
+        memmove(buffer + capacity - after_gap, buffer + old_capacity - after_gap, after_gap);
+    }
+    else
     {
-        current_line->gap_start--;
-        current_line->gap_end--;
-        current_line->number_characters--;
+        // A line buffer moves to the pool of the next size up and uses all of it
+        int size_class = buffer_class(capacity);
+        if (size_class >= LINE_BUFFER_CLASSES)
+        {
+            return 1;
+        }
+        buffer = pool_alloc(&buffer_pools[size_class], LINE_BUFFER_MINIMUM << size_class);
+        if (buffer == NULL)
+        {
+            return 1;
+        }
+        capacity = LINE_BUFFER_MINIMUM << size_class;
+        memcpy(buffer, current_line->buffer, gap_offset);
+        memcpy(buffer + capacity - after_gap, current_line->gap_end + 1, after_gap);
+        pool_free(&buffer_pools[buffer_class(old_capacity)], current_line->buffer);
     }
-    else if (current_line->gap_start != current_line->buffer)
+
+    // The text after the gap is at the new end of the buffer, and the gap takes up the rest
+    line_memory += capacity - old_capacity;
+    current_line->buffer = buffer;
+    current_line->buffer_end = buffer + capacity - 1;
+    current_line->gap_start = buffer + gap_offset;
+    current_line->gap_end = current_line->buffer_end - after_gap;
+    return 0;
+}
+
+int buffer_class(int capacity)
+{
+    int size_class = 0;
+    while (LINE_BUFFER_MINIMUM << size_class < capacity)
     {
-        current_line->gap_start--;
-        current_line->number_characters--;
+        size_class++;
     }
+    return size_class;
 }
 
 line* add_line(line* previous_line)
 {
-    line* new_line = malloc(sizeof(line));
+    line* new_line = pool_alloc(&line_pool, sizeof(line));
     if (new_line == NULL)
     {
         return NULL;
@@ -674,15 +1327,22 @@ line* add_line(line* previous_line)
     
     new_line->previous_line = previous_line;
     new_line->next_line = NULL;
-    new_line->buffer = calloc(max_x, sizeof(char));
+    // Every line starts out short and is grown as text goes in, paragraph buffers with realloc so they can't come out of the pools
+    int capacity = LINE_BUFFER_MINIMUM;
+    new_line->buffer = (paragraph_buffers) ? malloc(capacity) : pool_alloc(&buffer_pools[0], capacity);
     if (new_line->buffer == NULL)
     {
         return NULL;
     }
-    new_line->buffer_end = new_line->buffer + max_x - 1;
+    new_line->buffer_end = new_line->buffer + capacity - 1;
+    line_memory += sizeof(line) + capacity;
     new_line->gap_start = new_line->buffer;
     new_line->gap_end = new_line->buffer_end;
     new_line->number_characters = 0;
+    new_line->width = 0;
+    new_line->row_starts = NULL;
+    new_line->row_count = 0;
+    new_line->row_capacity = 0;
 
     if (previous_line != NULL)
     {
@@ -698,255 +1358,4109 @@ line* add_line(line* previous_line)
 
 void free_lines(line* ptr)
 {
-    if (ptr == NULL)
+    // Walking the list rather than recursing down it, a long paragraph has far more lines than the stack has room for
+    while (ptr != NULL)
     {
-        return;
+        line* next_line = ptr->next_line;
+        free_line(ptr);
+        ptr = next_line;
     }
-    free_lines(ptr->next_line);
-    free(ptr->buffer);
-    free(ptr);
 }
 
-paragraph* add_paragraph(paragraph* previous_paragraph)
+void free_line(line* ptr)
 {
-    paragraph* new_paragraph = malloc(sizeof(paragraph));
-    if (new_paragraph == NULL)
+    if (ptr == anchor_line)
     {
-        return NULL;
+        anchor_line = NULL;
     }
-
-    new_paragraph->previous_paragraph = previous_paragraph;
-    new_paragraph->next_paragraph = NULL;
-    new_paragraph->paragraph_start = add_line(NULL);
-    if (new_paragraph->paragraph_start == NULL)
+    line_memory -= sizeof(line) + (ptr->buffer_end - ptr->buffer + 1);
+    if (paragraph_buffers)
     {
-        return NULL;
+        drop_rows(ptr);
+        free(ptr->buffer);
     }
-    new_paragraph->paragraph_end = new_paragraph->paragraph_start;
-
-    if (previous_paragraph != NULL)
+    else
     {
-        new_paragraph->paragraph_start->line_number = previous_paragraph->paragraph_end->line_number + 1;
+        pool_free(&buffer_pools[buffer_class(ptr->buffer_end - ptr->buffer + 1)], ptr->buffer);
     }
+    pool_free(&line_pool, ptr);
+}
 
-    return new_paragraph;
+void free_paragraph(paragraph* ptr)
+{
+    // Only the paragraph itself and its pieces, its lines are freed with free_lines
+    free(ptr->spans);
+    unindex_paragraph(ptr);
+    pool_free(&paragraph_pool, ptr);
 }
 
-void free_paragraphs(paragraph* ptr)
+void free_paragraph_buffers(paragraph* paragraphs)
 {
-    if (ptr == NULL)
+    // Releasing the pools frees everything else, but paragraph buffers and packed blocks live outside them
+    free(scratch_text);
+    if (!paragraph_buffers && memory_budget == 0 && !piece_table)
     {
         return;
     }
-    free_paragraphs(ptr->next_paragraph);
-    free_lines(ptr->paragraph_start);
-    free(ptr);
-}
-
-void copy_lines(line* current_line, paragraph* target_paragraph)
-{    
-    line* target_line = target_paragraph->paragraph_end;
-    int destination = (target_line->number_characters == max_x) ? max_x - 1 : target_line->number_characters;
-    move_cursor_to(target_line, destination);
-
-    for (line* line_ptr = current_line; line_ptr != NULL; line_ptr = line_ptr->next_line)
+    for (paragraph* para_ptr = paragraphs; para_ptr != NULL; para_ptr = para_ptr->next_paragraph)
     {
-        if (line_ptr != current_line)
-        {
-            move_cursor_to(line_ptr, 0);
-        }
-
-        for (char* buffer_ptr = line_ptr->gap_start; buffer_ptr <= line_ptr->buffer_end; buffer_ptr++)
+        if (paragraph_buffers && para_ptr->paragraph_start != NULL)
         {
-            if (target_line->number_characters == max_x)
-            {
-                target_line->next_line = add_line(target_line);
-                target_line = target_line->next_line;
-                target_paragraph->paragraph_end = target_line;
-                addat_cursor(*buffer_ptr, target_line);
-            }
-            else if (line_ptr->number_characters == max_x)
-            {
-                addat_cursor(*buffer_ptr, target_line);
-            }
-            else if (buffer_ptr < line_ptr->gap_start || buffer_ptr > line_ptr->gap_end)
-            {
-                addat_cursor(*buffer_ptr, target_line);
-            }
+            free(para_ptr->paragraph_start->row_starts);
+            free(para_ptr->paragraph_start->buffer);
         }
+        free(para_ptr->packed_text);
+        free(para_ptr->spans);
     }
 }
 
-void shuffle_start(paragraph* current_paragraph, line* current_line)
+void* pool_alloc(pool* item_pool, size_t item_size)
 {
-    for (line* line_ptr = current_line; line_ptr->next_line != NULL; line_ptr = line_ptr->next_line)
+    if (item_pool->free_items != NULL)
     {
-        if (line_ptr->next_line->number_characters == max_x)
-        {
-            memcpy(line_ptr->buffer_end, line_ptr->next_line->buffer, 1);
-            memmove(line_ptr->next_line->buffer, line_ptr->next_line->buffer + 1, max_x - 1);
-        }
-        else
+        void* item = item_pool->free_items;
+        item_pool->free_items = *(void**) item;
+        return item;
+    }
+
+    // Free items are linked through their first bytes, so every item is rounded up to hold an aligned pointer
+    item_size = (item_size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+    if (item_pool->slab_next == NULL || item_pool->slab_end - item_pool->slab_next < (long) item_size)
+    {
+        size_t slab_size = (item_size + POOL_SLAB_HEADER > POOL_SLAB_SIZE) ? item_size + POOL_SLAB_HEADER : POOL_SLAB_SIZE;
+        char* slab = malloc(slab_size);
+        if (slab == NULL)
         {
-            if (line_ptr->next_line->gap_start == line_ptr->next_line->buffer)
-            {
-                memcpy(line_ptr->buffer_end, line_ptr->next_line->gap_end + 1, 1);
-                line_ptr->next_line->gap_end++;
-                line_ptr->next_line->number_characters--;
-            }
-            else
-            {
-                int move_size = line_ptr->next_line->gap_start - line_ptr->next_line->buffer;
-                memcpy(line_ptr->buffer_end, line_ptr->next_line->buffer, 1);
-                memmove(line_ptr->next_line->buffer, line_ptr->next_line->buffer + 1, move_size);
-                line_ptr->next_line->gap_start--;
-                line_ptr->next_line->number_characters--;
-            }
+            return NULL;
         }
+        *(void**) slab = item_pool->slabs;
+        item_pool->slabs = slab;
+        item_pool->slab_next = slab + POOL_SLAB_HEADER;
+        item_pool->slab_end = slab + slab_size;
     }
+    item_pool->item_size = item_size;
+
+    void* item = item_pool->slab_next;
+    item_pool->slab_next += item_size;
+    return item;
 }
 
-void shuffle_end(paragraph* current_paragraph, line* current_line, int line_counter)
+void pool_free(pool* item_pool, void* item)
 {
-    if (current_line->next_line != NULL)
-    {
-        shuffle_end(current_paragraph, current_line->next_line, line_counter + 1);
+    *(void**) item = item_pool->free_items;
+    item_pool->free_items = item;
+}
 
-        // On all the previous full lines
-        if (current_line->next_line->number_characters < max_x)
-        {
-            current_line->next_line->gap_end--;
-            memcpy(current_line->next_line->gap_end + 1, current_line->buffer_end, 1);
-        }
-        else
-        {
-            memcpy(current_line->next_line->buffer, current_line->buffer_end, 1);
-        }
+void pool_merge(pool* target_pool, pool* source_pool)
+{
+    // Whatever is left of the source's current slab goes on its free list so none of it is lost
+    while (source_pool->slab_next != NULL && source_pool->slab_end - source_pool->slab_next >= (long) source_pool->item_size)
+    {
+        pool_free(source_pool, source_pool->slab_next);
+        source_pool->slab_next += source_pool->item_size;
+    }
 
-        // Get the hell out on the first line
-        if (line_counter == 1)
-        {
-            return;
-        }
-        // Jiggle stuff around on subsequent lines
-        else
+    if (source_pool->free_items != NULL)
+    {
+        void* last_item = source_pool->free_items;
+        while (*(void**) last_item != NULL)
         {
-            memmove(current_line->buffer + 1, current_line->buffer, max_x - 1);
-            return;    
+            last_item = *(void**) last_item;
         }
+        *(void**) last_item = target_pool->free_items;
+        target_pool->free_items = source_pool->free_items;
     }
-    // On the empty line
-    else
+    if (source_pool->slabs != NULL)
     {
-        current_line->gap_end -= current_line->gap_start - current_line->buffer;
-        memmove(current_line->gap_end + 1, current_line->buffer, current_line->gap_start - current_line->buffer);
-        current_line->number_characters++;
-        if (current_line->gap_start != current_line->buffer)
+        void* last_slab = source_pool->slabs;
+        while (*(void**) last_slab != NULL)
         {
-            current_line->gap_start = current_line->buffer;    
+            last_slab = *(void**) last_slab;
         }
+        *(void**) last_slab = target_pool->slabs;
+        target_pool->slabs = source_pool->slabs;
     }
-    
-    if (current_line->number_characters == max_x)
-    {
-        current_line->next_line = add_line(current_line);
-        current_paragraph->paragraph_end = current_line->next_line;
-    }
-    return;
+    memset(source_pool, 0, sizeof(pool));
 }
 
-void print_lines(paragraph* paragraphs)
+void pool_release(pool* item_pool)
 {
-    for (paragraph* para_ptr = paragraphs; para_ptr != NULL; para_ptr = para_ptr->next_paragraph)
+    void* slab = item_pool->slabs;
+    while (slab != NULL)
     {
-        for (line* ptr = para_ptr->paragraph_start; ptr != NULL; ptr = ptr->next_line)
-        {
-            if (ptr->line_number >= display_top && ptr->line_number <= display_bottom)
-            {
-                for (char* ptr2 = ptr->buffer; ptr2 <= ptr->buffer_end; ptr2++)
-                {
-                    if (ptr->number_characters == max_x)
-                    {
-                        printw("%c", *ptr2);
-                    }
-                    else if (ptr2 < ptr->gap_start || ptr2 > ptr->gap_end)
-                    {
-                        printw("%c", *ptr2);
-                    }            
-                }
-                if (ptr->next_line == NULL)
-                {
-                    printw("\n");
-                }
-            }
-        }
+        void* next_slab = *(void**) slab;
+        free(slab);
+        slab = next_slab;
     }
+    memset(item_pool, 0, sizeof(pool));
 }
 
-void update_view(line* current_line)
+paragraph* add_paragraph(paragraph* previous_paragraph)
 {
-    int view_size = max_y - 1;
-
-    if (current_line->line_number < display_top)
+    paragraph* new_paragraph = pool_alloc(&paragraph_pool, sizeof(paragraph));
+    if (new_paragraph == NULL)
     {
-        display_top = current_line->line_number;
-        display_bottom = display_top + view_size;
+        return NULL;
     }
-    else if (current_line->line_number > display_bottom)
+
+    new_paragraph->previous_paragraph = previous_paragraph;
+    new_paragraph->next_paragraph = NULL;
+    new_paragraph->source_start = NULL;
+    new_paragraph->source_end = NULL;
+    new_paragraph->source_paragraphs = 0;
+    new_paragraph->source_lines = 0;
+    new_paragraph->spans = NULL;
+    new_paragraph->span_count = 0;
+    new_paragraph->packed_text = NULL;
+    new_paragraph->last_edit = 0;
+    new_paragraph->width = max_x;
+    new_paragraph->paragraph_start = add_line(NULL);
+    if (new_paragraph->paragraph_start == NULL)
     {
-        display_top = current_line->line_number - view_size;
-        display_bottom = current_line->line_number;
+        return NULL;
     }
+    new_paragraph->paragraph_end = new_paragraph->paragraph_start;
+    index_paragraph(new_paragraph, previous_paragraph);
+
+    return new_paragraph;
 }
 
-void update_cursor_position(line* current_line)
+paragraph* add_lazy_paragraph(paragraph* previous_paragraph, char* text, char* text_end, int source_paragraphs, int source_lines)
 {
+    paragraph* new_paragraph = pool_alloc(&paragraph_pool, sizeof(paragraph));
+    if (new_paragraph == NULL)
+    {
+        return NULL;
+    }
 
-    y = current_line->line_number - display_top;
+    new_paragraph->previous_paragraph = previous_paragraph;
+    new_paragraph->next_paragraph = NULL;
+    new_paragraph->paragraph_start = NULL;
+    new_paragraph->paragraph_end = NULL;
+    new_paragraph->source_start = text;
+    new_paragraph->source_end = text_end;
+    new_paragraph->source_paragraphs = source_paragraphs;
+    new_paragraph->source_lines = source_lines;
+    new_paragraph->spans = NULL;
+    new_paragraph->span_count = 0;
+    new_paragraph->packed_text = NULL;
+    new_paragraph->last_edit = 0;
+    new_paragraph->width = max_x;
+    index_paragraph(new_paragraph, previous_paragraph);
 
-    x = current_line->gap_start - current_line->buffer;
+    return new_paragraph;
 }
 
-void fix_line_numbers(paragraph* current_paragraph)
+void count_paragraphs(char* text, char* text_end, int* source_paragraphs, int* source_lines)
 {
-    if (current_paragraph->next_paragraph == NULL)
+    // Counting the lines each paragraph will wrap to once it is built, without building it
+    *source_paragraphs = 0;
+    *source_lines = 0;
+    for (char* ptr = text; ; )
     {
-        return;
-    }
-    for (paragraph* para_ptr = current_paragraph; para_ptr != NULL; para_ptr = para_ptr->next_paragraph)
-    {
-        for (line* line_ptr = para_ptr->paragraph_start; line_ptr != NULL; line_ptr = line_ptr->next_line)
+        char* newline = memchr(ptr, '\n', text_end - ptr);
+        char* paragraph_text_end = (newline == NULL) ? text_end : newline;
+
+        (*source_paragraphs)++;
+        *source_lines += count_rows(ptr, paragraph_text_end);
+
+        if (newline == NULL)
         {
-            line_ptr->line_number = (line_ptr->previous_line == NULL) ? para_ptr->previous_paragraph->paragraph_end->line_number + 1 : line_ptr->previous_line->line_number + 1;
+            break;
         }
+        ptr = newline + 1;
     }
 }
 
-void write_paragraphs(paragraph* paragraphs, FILE* write_file)
+paragraph* build_paragraph(paragraph* lazy_paragraph, int line_number, int source_index)
 {
-    char enter = '\n';
-    for (paragraph* para_ptr = paragraphs; para_ptr != NULL; para_ptr = para_ptr->next_paragraph)
+    if (lazy_paragraph->packed_text != NULL)
     {
-        for (line* ptr = para_ptr->paragraph_start; ptr != NULL; ptr = ptr->next_line)
+        return unpack_paragraphs(lazy_paragraph, line_number, source_index);
+    }
+
+    // A paragraph in several pieces is built from them joined up in scratch, and the built one keeps them to compare its edits against
+    piece_span* spans = lazy_paragraph->spans;
+    int span_count = lazy_paragraph->span_count;
+    if (spans != NULL)
+    {
+        lazy_paragraph->source_start = piece_text(lazy_paragraph, &lazy_paragraph->source_end);
+        if (lazy_paragraph->source_start == NULL)
+        {
+            return NULL;
+        }
+        lazy_paragraph->spans = NULL;
+    }
+    rewrap_paragraph(lazy_paragraph, NULL);
+
+    // Finding the first paragraph in the lazy text that holds line_number or is number source_index in it
+    char* text = lazy_paragraph->source_start;
+    int lazy_first_line = first_line_number(lazy_paragraph);
+    int first_line = lazy_first_line;
+    int index = 0;
+    char* newline = memchr(text, '\n', lazy_paragraph->source_end - text);
+    int rows = (newline != NULL) ? count_rows(text, newline) : 0;
+    while (newline != NULL && index < source_index && first_line + rows - 1 < line_number)
+    {
+        first_line += rows;
+        index++;
+        text = newline + 1;
+        newline = memchr(text, '\n', lazy_paragraph->source_end - text);
+        rows = (newline != NULL) ? count_rows(text, newline) : 0;
+    }
+    char* text_end = (newline == NULL) ? lazy_paragraph->source_end : newline;
+
+    paragraph* previous_paragraph = lazy_paragraph->previous_paragraph;
+    paragraph* next_paragraph = lazy_paragraph->next_paragraph;
+    char* source_end = lazy_paragraph->source_end;
+    int source_paragraphs = lazy_paragraph->source_paragraphs;
+    int source_lines = lazy_paragraph->source_lines;
+
+    // The lazy paragraph keeps any text before the one being built
+    if (index > 0)
+    {
+        lazy_paragraph->source_end = text - 1;
+        lazy_paragraph->source_paragraphs = index;
+        lazy_paragraph->source_lines = first_line - lazy_first_line;
+        previous_paragraph = lazy_paragraph;
+        fix_line_numbers(lazy_paragraph);
+    }
+
+    paragraph* built_paragraph = add_paragraph(previous_paragraph);
+    if (built_paragraph == NULL || append_text(built_paragraph, text, text_end - text) == NULL)
+    {
+        return NULL;
+    }
+    previous_paragraph->next_paragraph = built_paragraph;
+    int built_lines = count_lines(built_paragraph);
+
+    // Until it is edited the built paragraph can go back to being this piece of text
+    built_paragraph->source_start = text;
+    built_paragraph->source_end = text_end;
+    if (spans != NULL)
+    {
+        built_paragraph->source_start = NULL;
+        built_paragraph->source_end = NULL;
+        built_paragraph->spans = spans;
+        built_paragraph->span_count = span_count;
+    }
+
+    // Any text after it stays lazy, reusing the original paragraph if it is free
+    if (newline != NULL)
+    {
+        paragraph* rest = lazy_paragraph;
+        if (index > 0)
+        {
+            rest = pool_alloc(&paragraph_pool, sizeof(paragraph));
+            if (rest == NULL)
+            {
+                return NULL;
+            }
+            rest->paragraph_start = NULL;
+            rest->paragraph_end = NULL;
+            rest->spans = NULL;
+            rest->span_count = 0;
+            rest->packed_text = NULL;
+            rest->last_edit = 0;
+            rest->width = max_x;
+        }
+        rest->source_start = newline + 1;
+        rest->source_end = source_end;
+        rest->source_paragraphs = source_paragraphs - index - 1;
+        rest->source_lines = source_lines - (first_line - lazy_first_line) - built_lines;
+        if (rest == lazy_paragraph)
+        {
+            fix_line_numbers(rest);
+        }
+        else
+        {
+            index_paragraph(rest, built_paragraph);
+        }
+        rest->previous_paragraph = built_paragraph;
+        rest->next_paragraph = next_paragraph;
+        built_paragraph->next_paragraph = rest;
+        next_paragraph = rest;
+    }
+    else
+    {
+        built_paragraph->next_paragraph = next_paragraph;
+        if (index == 0)
+        {
+            free_paragraph(lazy_paragraph);
+        }
+    }
+
+    if (next_paragraph != NULL)
+    {
+        next_paragraph->previous_paragraph = built_paragraph;
+    }
+    return built_paragraph;
+}
+
+int build_neighbours(paragraph* current_paragraph)
+{
+    // Neighbours left at another width by a resize are wrapped again, and the last paragraph of lazy text before is found however its lines now count
+    paragraph* previous_paragraph = current_paragraph->previous_paragraph;
+    if (previous_paragraph != NULL && previous_paragraph->paragraph_start == NULL)
+    {
+        if (build_paragraph(previous_paragraph, INT_MAX, INT_MAX) == NULL)
+        {
+            return 1;
+        }
+    }
+    else if (previous_paragraph != NULL && rewrap_paragraph(previous_paragraph, NULL) != 0)
+    {
+        return 1;
+    }
+
+    paragraph* next_paragraph = current_paragraph->next_paragraph;
+    if (next_paragraph != NULL && next_paragraph->paragraph_start == NULL)
+    {
+        if (build_paragraph(next_paragraph, first_line_number(next_paragraph), INT_MAX) == NULL)
+        {
+            return 1;
+        }
+    }
+    else if (next_paragraph != NULL && rewrap_paragraph(next_paragraph, NULL) != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+int release_paragraphs(paragraph* current_paragraph, int whole_document)
+{
+    // The cursor's paragraph and the ones either side of it stay built, and further out the built ones run up to the first piece
+    paragraph* para_ptr = (current_paragraph->next_paragraph != NULL) ? current_paragraph->next_paragraph->next_paragraph : NULL;
+    for ( ; para_ptr != NULL && (whole_document || para_ptr->paragraph_start != NULL); para_ptr = para_ptr->next_paragraph)
+    {
+        if (para_ptr->paragraph_start != NULL && release_paragraph(para_ptr) != 0)
+        {
+            return 1;
+        }
+    }
+    para_ptr = (current_paragraph->previous_paragraph != NULL) ? current_paragraph->previous_paragraph->previous_paragraph : NULL;
+    for ( ; para_ptr != NULL && (whole_document || para_ptr->paragraph_start != NULL); para_ptr = para_ptr->previous_paragraph)
+    {
+        if (para_ptr->paragraph_start != NULL && release_paragraph(para_ptr) != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int release_paragraph(paragraph* built_paragraph)
+{
+    // The first paragraph heads the list and the one being followed is still growing, so both stay built
+    if (built_paragraph->previous_paragraph == NULL || built_paragraph == follow_paragraph)
+    {
+        return 0;
+    }
+
+    // Edited text goes to the add buffer, all of it or with -t only what differs from the pieces it was built from, and anything else still has the text it was built from
+    if (built_paragraph->source_start == NULL && built_paragraph->spans == NULL)
+    {
+        char* text = pool_alloc(&add_buffer, paragraph_length(built_paragraph));
+        if (text == NULL)
+        {
+            return 1;
+        }
+        built_paragraph->source_start = text;
+        built_paragraph->source_end = copy_paragraph_text(built_paragraph, text);
+    }
+    else if (built_paragraph->source_start == NULL && store_edit(built_paragraph) != 0)
+    {
+        return 1;
+    }
+
+    built_paragraph->source_paragraphs = 1;
+    built_paragraph->source_lines = count_lines(built_paragraph);
+    free_lines(built_paragraph->paragraph_start);
+    built_paragraph->paragraph_start = NULL;
+    built_paragraph->paragraph_end = NULL;
+    return 0;
+}
+
+void forget_source(paragraph* edited_paragraph)
+{
+    // An edited paragraph no longer matches the text it was built from, but with -t that text is kept as its one piece so release_paragraph can find what changed
+    if (piece_table && edited_paragraph->source_start != NULL && edited_paragraph->spans == NULL)
+    {
+        edited_paragraph->spans = malloc(sizeof(piece_span));
+        if (edited_paragraph->spans != NULL)
+        {
+            edited_paragraph->spans[0].text = edited_paragraph->source_start;
+            edited_paragraph->spans[0].length = edited_paragraph->source_end - edited_paragraph->source_start;
+            edited_paragraph->span_count = 1;
+        }
+    }
+    edited_paragraph->source_start = NULL;
+}
+
+int store_edit(paragraph* edited_paragraph)
+{
+    long length = paragraph_length(edited_paragraph);
+    char* text = pack_scratch(length);
+    if (text == NULL)
+    {
+        return 1;
+    }
+    copy_paragraph_text(edited_paragraph, text);
+
+    // Most edits leave the start and the end of a paragraph alone, so the pieces are matched against the text from both ends
+    // In a paragraph cut into too many pieces only the first and last are matched, so everything between them is copied into one again
+    piece_span* old_spans = edited_paragraph->spans;
+    int old_count = edited_paragraph->span_count;
+    long old_length = 0;
+    for (int i = 0; i < old_count; i++)
+    {
+        old_length += old_spans[i].length;
+    }
+    int matched_spans = (old_count >= PIECE_SPANS_MAX) ? 1 : old_count;
+    long limit = (length < old_length) ? length : old_length;
+    long head = 0;
+    for (int i = 0; i < matched_spans && head < limit; i++)
+    {
+        long same = 0;
+        while (same < old_spans[i].length && head + same < limit && old_spans[i].text[same] == text[head + same])
+        {
+            same++;
+        }
+        head += same;
+        if (same < old_spans[i].length)
+        {
+            break;
+        }
+    }
+    long tail = 0;
+    for (int i = old_count - 1; i >= old_count - matched_spans && head + tail < limit; i--)
+    {
+        long same = 0;
+        while (same < old_spans[i].length && head + tail + same < limit && old_spans[i].text[old_spans[i].length - 1 - same] == text[length - 1 - tail - same])
+        {
+            same++;
+        }
+        tail += same;
+        if (same < old_spans[i].length)
+        {
+            break;
+        }
+    }
+
+    // Only the text between them is new, and the start can end and the end begin part way into a piece
+    piece_span* spans = malloc((old_count + 2) * sizeof(piece_span));
+    if (spans == NULL)
+    {
+        return 1;
+    }
+    char* added_text = pool_alloc(&add_buffer, length - head - tail);
+    if (added_text == NULL)
+    {
+        free(spans);
+        return 1;
+    }
+    memcpy(added_text, text + head, length - head - tail);
+
+    int span_count = 0;
+    long offset = 0;
+    for (int i = 0; i < old_count && offset < head; i++)
+    {
+        span_count = add_span(spans, span_count, old_spans[i].text, (head - offset < old_spans[i].length) ? head - offset : old_spans[i].length);
+        offset += old_spans[i].length;
+    }
+    span_count = add_span(spans, span_count, added_text, length - head - tail);
+    offset = 0;
+    for (int i = 0; i < old_count; i++)
+    {
+        long skipped = (old_length - tail > offset) ? old_length - tail - offset : 0;
+        if (skipped < old_spans[i].length)
         {
-            for (char* ptr2 = ptr->buffer; ptr2 < ptr->buffer + max_x; ptr2++)
+            span_count = add_span(spans, span_count, old_spans[i].text + skipped, old_spans[i].length - skipped);
+        }
+        offset += old_spans[i].length;
+    }
+    free(old_spans);
+
+    // A paragraph left in one piece is just that text, like one that was never edited
+    if (span_count <= 1)
+    {
+        edited_paragraph->source_start = (span_count == 1) ? spans[0].text : added_text;
+        edited_paragraph->source_end = (span_count == 1) ? spans[0].text + spans[0].length : added_text;
+        free(spans);
+        spans = NULL;
+        span_count = 0;
+    }
+    edited_paragraph->spans = spans;
+    edited_paragraph->span_count = span_count;
+    return 0;
+}
+
+int add_span(piece_span* spans, int span_count, char* text, long length)
+{
+    // Empty pieces are left out, and one that carries straight on from the last is joined to it
+    if (length == 0)
+    {
+        return span_count;
+    }
+    if (span_count > 0 && spans[span_count - 1].text + spans[span_count - 1].length == text)
+    {
+        spans[span_count - 1].length += length;
+        return span_count;
+    }
+    spans[span_count].text = text;
+    spans[span_count].length = length;
+    return span_count + 1;
+}
+
+char* piece_text(paragraph* lazy_paragraph, char** text_end)
+{
+    // Text in one piece is used where it is, and text in several is joined up in scratch
+    if (lazy_paragraph->spans == NULL)
+    {
+        *text_end = lazy_paragraph->source_end;
+        return lazy_paragraph->source_start;
+    }
+    long length = 0;
+    for (int i = 0; i < lazy_paragraph->span_count; i++)
+    {
+        length += lazy_paragraph->spans[i].length;
+    }
+    char* text = pack_scratch(length);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+    *text_end = text;
+    for (int i = 0; i < lazy_paragraph->span_count; i++)
+    {
+        memcpy(*text_end, lazy_paragraph->spans[i].text, lazy_paragraph->spans[i].length);
+        *text_end += lazy_paragraph->spans[i].length;
+    }
+    return text;
+}
+
+char* copy_paragraph_text(paragraph* built_paragraph, char* text)
+{
+    for (line* line_ptr = built_paragraph->paragraph_start; line_ptr != NULL; line_ptr = line_ptr->next_line)
+    {
+        memcpy(text, line_ptr->buffer, line_ptr->gap_start - line_ptr->buffer);
+        text += line_ptr->gap_start - line_ptr->buffer;
+        memcpy(text, line_ptr->gap_end + 1, line_ptr->buffer_end - line_ptr->gap_end);
+        text += line_ptr->buffer_end - line_ptr->gap_end;
+    }
+    return text;
+}
+
+int rewrap_paragraph(paragraph* stale_paragraph, line** cursor_line)
+{
+    // Packed text is counted again when it is unpacked
+    if (stale_paragraph->width == max_x || stale_paragraph->packed_text != NULL)
+    {
+        return 0;
+    }
+    stale_paragraph->width = max_x;
+    int line_count = stale_paragraph->line_count;
+
+    // Lazy text only needs counting again, and a paragraph buffer wraps itself when it is drawn
+    if (stale_paragraph->paragraph_start == NULL)
+    {
+        char* text_end;
+        char* text = piece_text(stale_paragraph, &text_end);
+        if (text == NULL)
+        {
+            return 1;
+        }
+        int source_paragraphs;
+        count_paragraphs(text, text_end, &source_paragraphs, &stale_paragraph->source_lines);
+    }
+    else if (!paragraph_buffers)
+    {
+        // The cursor keeps its place in the paragraph's text through the rebuild
+        long cursor_offset = 0;
+        if (cursor_line != NULL)
+        {
+            cursor_offset = (*cursor_line)->gap_start - (*cursor_line)->buffer;
+            for (line* line_ptr = (*cursor_line)->previous_line; line_ptr != NULL; line_ptr = line_ptr->previous_line)
+            {
+                cursor_offset += line_ptr->number_characters;
+            }
+        }
+
+        long length = paragraph_length(stale_paragraph);
+        char* text = pack_scratch(length);
+        if (text == NULL)
+        {
+            return 1;
+        }
+        copy_paragraph_text(stale_paragraph, text);
+        free_lines(stale_paragraph->paragraph_start);
+        stale_paragraph->paragraph_start = add_line(NULL);
+        if (stale_paragraph->paragraph_start == NULL)
+        {
+            return 1;
+        }
+        stale_paragraph->paragraph_end = stale_paragraph->paragraph_start;
+        if (append_text(stale_paragraph, text, length) == NULL)
+        {
+            return 1;
+        }
+
+        if (cursor_line != NULL)
+        {
+            *cursor_line = seek_offset(stale_paragraph, cursor_offset);
+        }
+    }
+    fix_line_numbers(stale_paragraph);
+    shift_view(first_line_number(stale_paragraph), stale_paragraph->line_count - line_count);
+    return 0;
+}
+
+int pack_paragraphs(paragraph* current_paragraph)
+{
+    // Packing goes on until a quarter of the budget is free, so it doesn't have to start again on the next key
+    if (line_memory + packed_memory <= memory_budget || line_memory + packed_memory < pack_again)
+    {
+        return 0;
+    }
+
+    // Paragraphs more than a screen away from the view are cold, and whichever end of the document is further from it goes first
+    int cold_top = display_top - max_y;
+    int cold_bottom = display_bottom + max_y;
+    paragraph* front = find_line(0)->next_paragraph;
+    paragraph* back = find_line(INT_MAX);
+    while (line_memory + packed_memory > memory_budget - memory_budget / 4)
+    {
+        int front_line = (front != NULL) ? first_line_number(front) : 0;
+        int back_line = (back != NULL) ? first_line_number(back) : 0;
+        int front_cold = (front != NULL && front_line + count_lines(front) <= cold_top);
+        int back_cold = (back != NULL && back_line > cold_bottom);
+
+        // With nothing cold left, trying again waits until another block's worth has been built
+        if (!front_cold && !back_cold)
+        {
+            pack_again = line_memory + packed_memory + PACK_BLOCK_SIZE;
+            return 0;
+        }
+        int forward = front_cold && (!back_cold || cold_top - front_line >= back_line - cold_bottom);
+
+        paragraph* first_paragraph = (forward) ? front : back;
+        paragraph* last_paragraph = first_paragraph;
+        if (paragraph_cold(first_paragraph, current_paragraph) && first_paragraph->source_start == NULL && first_paragraph->spans == NULL)
+        {
+            // Edited paragraphs next to each other go into one block, which compresses far better than each on its own
+            long length = paragraph_length(first_paragraph);
+            while (length < PACK_BLOCK_SIZE)
             {
-                if (ptr->number_characters == max_x)
+                paragraph* next_paragraph = (forward) ? last_paragraph->next_paragraph : first_paragraph->previous_paragraph;
+                if (next_paragraph == NULL || !paragraph_cold(next_paragraph, current_paragraph) || next_paragraph->source_start != NULL || next_paragraph->spans != NULL || next_paragraph->width != first_paragraph->width)
+                {
+                    break;
+                }
+                int next_line = first_line_number(next_paragraph);
+                if ((forward) ? next_line + count_lines(next_paragraph) > cold_top : next_line <= cold_bottom)
+                {
+                    break;
+                }
+                length += paragraph_length(next_paragraph) + 1;
+                if (forward)
                 {
-                    fwrite(ptr2, 1, 1, write_file);
+                    last_paragraph = next_paragraph;
                 }
                 else
                 {
-                    if (ptr2 < ptr->gap_start || ptr2 > ptr->gap_end)
-                    {
-                        fwrite(ptr2, 1, 1, write_file);
-                    }
+                    first_paragraph = next_paragraph;
                 }
             }
-            if (ptr->next_line == NULL && para_ptr->next_paragraph != NULL)
+        }
+        if (forward)
+        {
+            front = last_paragraph->next_paragraph;
+        }
+        else
+        {
+            back = first_paragraph->previous_paragraph;
+        }
+
+        // Text that was never edited is still where it was built from, and text kept in pieces only adds what its edits changed, so only their lines need to go
+        if (!paragraph_cold(first_paragraph, current_paragraph))
+        {
+            continue;
+        }
+        if (first_paragraph->source_start != NULL || first_paragraph->spans != NULL)
+        {
+            if (release_paragraph(first_paragraph) != 0)
             {
-                fwrite(&enter, 1, 1, write_file);
+                return 1;
             }
         }
+        else if (pack_run(first_paragraph, last_paragraph) != 0)
+        {
+            return 1;
+        }
+    }
+    pack_again = 0;
+    return 0;
+}
+
+int pack_run(paragraph* first_paragraph, paragraph* last_paragraph)
+{
+    // Gathering the text with a new line between the paragraphs, as it would be in the file
+    long length = 0;
+    int source_paragraphs = 0;
+    int source_lines = 0;
+    for (paragraph* para_ptr = first_paragraph; para_ptr != last_paragraph->next_paragraph; para_ptr = para_ptr->next_paragraph)
+    {
+        length += paragraph_length(para_ptr) + 1;
+        source_paragraphs++;
+        source_lines += count_lines(para_ptr);
+    }
+    length--;
+    char* text = pack_scratch(length);
+    if (text == NULL)
+    {
+        return 1;
+    }
+    char* text_end = text;
+    for (paragraph* para_ptr = first_paragraph; para_ptr != last_paragraph->next_paragraph; para_ptr = para_ptr->next_paragraph)
+    {
+        text_end = copy_paragraph_text(para_ptr, text_end);
+        if (para_ptr != last_paragraph)
+        {
+            *text_end++ = '\n';
+        }
+    }
+
+    // Text that doesn't compress at all only grows by a byte in every 255 and a little at the end
+    char* packed = malloc(length + length / 255 + 16);
+    if (packed == NULL)
+    {
+        return 1;
+    }
+    int packed_size = pack_text(text, length, packed);
+    char* shrunk = realloc(packed, packed_size);
+    packed = (shrunk != NULL) ? shrunk : packed;
+
+    // The first paragraph becomes the packed one and the rest of the run is freed
+    paragraph* next_paragraph = last_paragraph->next_paragraph;
+    while (first_paragraph->next_paragraph != next_paragraph)
+    {
+        paragraph* old_paragraph = first_paragraph->next_paragraph;
+        first_paragraph->next_paragraph = old_paragraph->next_paragraph;
+        free_lines(old_paragraph->paragraph_start);
+        free_paragraph(old_paragraph);
+    }
+    if (next_paragraph != NULL)
+    {
+        next_paragraph->previous_paragraph = first_paragraph;
+    }
+    free_lines(first_paragraph->paragraph_start);
+    first_paragraph->paragraph_start = NULL;
+    first_paragraph->paragraph_end = NULL;
+    first_paragraph->source_start = NULL;
+    first_paragraph->source_end = NULL;
+    first_paragraph->packed_text = packed;
+    first_paragraph->packed_size = packed_size;
+    first_paragraph->unpacked_size = length;
+    first_paragraph->source_paragraphs = source_paragraphs;
+    first_paragraph->source_lines = source_lines;
+    fix_line_numbers(first_paragraph);
+    packed_memory += packed_size;
+    return 0;
+}
+
+int paragraph_cold(paragraph* built_paragraph, paragraph* current_paragraph)
+{
+    // Besides the paragraphs release_paragraph keeps, the cursor's paragraph and the ones it can step into stay built
+    if (built_paragraph->paragraph_start == NULL || built_paragraph->previous_paragraph == NULL || built_paragraph == follow_paragraph)
+    {
+        return 0;
+    }
+    if (built_paragraph == current_paragraph || built_paragraph == current_paragraph->previous_paragraph || built_paragraph == current_paragraph->next_paragraph)
+    {
+        return 0;
+    }
+    return built_paragraph->last_edit == 0 || edit_clock - built_paragraph->last_edit >= PACK_COLD_EDITS;
+}
+
+long paragraph_length(paragraph* built_paragraph)
+{
+    long length = 0;
+    for (line* line_ptr = built_paragraph->paragraph_start; line_ptr != NULL; line_ptr = line_ptr->next_line)
+    {
+        length += line_ptr->number_characters;
+    }
+    return length;
+}
+
+paragraph* unpack_paragraphs(paragraph* packed_paragraph, int line_number, int source_index)
+{
+    char* text = pack_scratch(packed_paragraph->unpacked_size);
+    if (text == NULL)
+    {
+        return NULL;
     }
-}
\ No newline at end of file
+    unpack_text(packed_paragraph->packed_text, packed_paragraph->packed_size, text);
+    packed_memory -= packed_paragraph->packed_size;
+    free(packed_paragraph->packed_text);
+    packed_paragraph->packed_text = NULL;
+    packed_paragraph->source_start = text;
+    packed_paragraph->source_end = text + packed_paragraph->unpacked_size;
+
+    // The unpacked text is only scratch, so every paragraph in the block is built from it straight away
+    int source_paragraphs = packed_paragraph->source_paragraphs;
+    int first_line = first_line_number(packed_paragraph);
+    paragraph* wanted_paragraph = NULL;
+    paragraph* para_ptr = packed_paragraph;
+    for (int i = 0; i < source_paragraphs; i++)
+    {
+        paragraph* built_paragraph = build_paragraph(para_ptr, line_number, 0);
+        if (built_paragraph == NULL)
+        {
+            return NULL;
+        }
+        built_paragraph->source_start = NULL;
+        built_paragraph->source_end = NULL;
+
+        // The same paragraph build_paragraph would have picked out of the block
+        first_line += count_lines(built_paragraph);
+        if (wanted_paragraph == NULL && (i >= source_index || first_line > line_number || i == source_paragraphs - 1))
+        {
+            wanted_paragraph = built_paragraph;
+        }
+        para_ptr = built_paragraph->next_paragraph;
+    }
+    return wanted_paragraph;
+}
+
+char* pack_scratch(long size)
+{
+    // One byte more than asked for, so even an empty paragraph gets somewhere to go
+    if (size >= scratch_size)
+    {
+        char* text = realloc(scratch_text, size + 1);
+        if (text == NULL)
+        {
+            return NULL;
+        }
+        scratch_text = text;
+        scratch_size = size + 1;
+    }
+    return scratch_text;
+}
+
+int pack_text(char* text, int length, char* packed)
+{
+    // LZ77 in the style of LZ4, each sequence being a run of literals followed by a copy of earlier text
+    int table[1 << PACK_HASH_BITS];
+    for (int i = 0; i < 1 << PACK_HASH_BITS; i++)
+    {
+        table[i] = -1;
+    }
+
+    int packed_size = 0;
+    int anchor = 0;
+    int position = 0;
+    while (position + PACK_MIN_MATCH <= length)
+    {
+        unsigned int sequence;
+        memcpy(&sequence, text + position, sizeof(sequence));
+        int hash = (sequence * 2654435761u) >> (32 - PACK_HASH_BITS);
+        int candidate = table[hash];
+        table[hash] = position;
+        if (candidate < 0 || position - candidate > PACK_MAX_OFFSET || memcmp(text + candidate, text + position, PACK_MIN_MATCH) != 0)
+        {
+            position++;
+            continue;
+        }
+
+        int match_length = PACK_MIN_MATCH;
+        while (position + match_length < length && text[candidate + match_length] == text[position + match_length])
+        {
+            match_length++;
+        }
+        packed_size = pack_sequence(packed, packed_size, text + anchor, position - anchor, position - candidate, match_length);
+        position += match_length;
+        anchor = position;
+    }
+
+    // The last sequence is only literals, and unpacking knows it has ended because the text is complete
+    return pack_sequence(packed, packed_size, text + anchor, length - anchor, 0, 0);
+}
+
+int pack_sequence(char* packed, int packed_size, char* literals, int literal_length, int offset, int match_length)
+{
+    // The token holds both lengths in four bits each, and longer ones carry on in the bytes after it
+    int literal_code = (literal_length < 15) ? literal_length : 15;
+    int match_code = (match_length - PACK_MIN_MATCH < 15) ? match_length - PACK_MIN_MATCH : 15;
+    packed[packed_size++] = literal_code << 4 | ((match_length > 0) ? match_code : 0);
+    if (literal_code == 15)
+    {
+        packed_size = pack_length(packed, packed_size, literal_length - 15);
+    }
+    memcpy(packed + packed_size, literals, literal_length);
+    packed_size += literal_length;
+
+    if (match_length > 0)
+    {
+        packed[packed_size++] = offset & 0xff;
+        packed[packed_size++] = offset >> 8;
+        if (match_code == 15)
+        {
+            packed_size = pack_length(packed, packed_size, match_length - PACK_MIN_MATCH - 15);
+        }
+    }
+    return packed_size;
+}
+
+int pack_length(char* packed, int packed_size, int length)
+{
+    while (length >= 255)
+    {
+        packed[packed_size++] = (char) 255;
+        length -= 255;
+    }
+    packed[packed_size++] = length;
+    return packed_size;
+}
+
+void unpack_text(char* packed, int packed_size, char* text)
+{
+    unsigned char* input = (unsigned char*) packed;
+    unsigned char* input_end = input + packed_size;
+    while (input < input_end)
+    {
+        int token = *input++;
+        int literal_length = token >> 4;
+        if (literal_length == 15)
+        {
+            while (*input == 255)
+            {
+                literal_length += *input++;
+            }
+            literal_length += *input++;
+        }
+        memcpy(text, input, literal_length);
+        text += literal_length;
+        input += literal_length;
+        if (input == input_end)
+        {
+            break;
+        }
+
+        int offset = input[0] | input[1] << 8;
+        input += 2;
+        int match_length = (token & 15) + PACK_MIN_MATCH;
+        if ((token & 15) == 15)
+        {
+            while (*input == 255)
+            {
+                match_length += *input++;
+            }
+            match_length += *input++;
+        }
+
+        // Copying a byte at a time, since a match can run on into the text it is making
+        for (int i = 0; i < match_length; i++)
+        {
+            text[i] = text[i - offset];
+        }
+        text += match_length;
+    }
+}
+
+int last_line_number(paragraph* current_paragraph)
+{
+    return first_line_number(current_paragraph) + count_lines(current_paragraph) - 1;
+}
+
+void build_line_index(paragraph* paragraphs)
+{
+    // Building the treap in one pass down the list, keeping the nodes down its right edge linked through their parents
+    paragraph* last_node = NULL;
+    line_index_root = NULL;
+    for (paragraph* para_ptr = paragraphs; para_ptr != NULL; para_ptr = para_ptr->next_paragraph)
+    {
+        para_ptr->tree_priority = rand();
+        para_ptr->line_count = count_lines(para_ptr);
+        para_ptr->tree_left = NULL;
+        para_ptr->tree_right = NULL;
+
+        // Nodes with a lower priority leave the right edge and go under the new one, their subtrees now complete
+        paragraph* node = last_node;
+        paragraph* finished_node = NULL;
+        while (node != NULL && node->tree_priority < para_ptr->tree_priority)
+        {
+            count_tree_lines(node);
+            finished_node = node;
+            node = node->tree_parent;
+        }
+        para_ptr->tree_left = finished_node;
+        if (finished_node != NULL)
+        {
+            finished_node->tree_parent = para_ptr;
+        }
+        para_ptr->tree_parent = node;
+        if (node != NULL)
+        {
+            node->tree_right = para_ptr;
+        }
+        else
+        {
+            line_index_root = para_ptr;
+        }
+        last_node = para_ptr;
+    }
+    for (paragraph* node = last_node; node != NULL; node = node->tree_parent)
+    {
+        count_tree_lines(node);
+    }
+    line_index_ready = 1;
+}
+
+void index_paragraph(paragraph* new_paragraph, paragraph* previous_paragraph)
+{
+    // Loader threads make paragraphs before there is an index, which is then built from the whole list
+    if (!line_index_ready)
+    {
+        return;
+    }
+    new_paragraph->tree_priority = rand();
+    new_paragraph->line_count = count_lines(new_paragraph);
+    new_paragraph->tree_lines = new_paragraph->line_count;
+    new_paragraph->tree_left = NULL;
+    new_paragraph->tree_right = NULL;
+
+    // The paragraph after previous_paragraph is the leftmost node of its right subtree
+    paragraph* node = (previous_paragraph == NULL) ? line_index_root : previous_paragraph->tree_right;
+    if (node == NULL)
+    {
+        new_paragraph->tree_parent = previous_paragraph;
+        if (previous_paragraph == NULL)
+        {
+            line_index_root = new_paragraph;
+        }
+        else
+        {
+            previous_paragraph->tree_right = new_paragraph;
+        }
+    }
+    else
+    {
+        while (node->tree_left != NULL)
+        {
+            node = node->tree_left;
+        }
+        node->tree_left = new_paragraph;
+        new_paragraph->tree_parent = node;
+    }
+    for (node = new_paragraph->tree_parent; node != NULL; node = node->tree_parent)
+    {
+        node->tree_lines += new_paragraph->line_count;
+    }
+
+    while (new_paragraph->tree_parent != NULL && new_paragraph->tree_parent->tree_priority < new_paragraph->tree_priority)
+    {
+        rotate_up(new_paragraph);
+    }
+}
+
+void unindex_paragraph(paragraph* old_paragraph)
+{
+    if (!line_index_ready)
+    {
+        return;
+    }
+
+    // Rotating the paragraph down until it has at most one child, which then takes its place
+    while (old_paragraph->tree_left != NULL && old_paragraph->tree_right != NULL)
+    {
+        rotate_up((old_paragraph->tree_left->tree_priority > old_paragraph->tree_right->tree_priority) ? old_paragraph->tree_left : old_paragraph->tree_right);
+    }
+    for (paragraph* node = old_paragraph->tree_parent; node != NULL; node = node->tree_parent)
+    {
+        node->tree_lines -= old_paragraph->line_count;
+    }
+
+    paragraph* child = (old_paragraph->tree_left != NULL) ? old_paragraph->tree_left : old_paragraph->tree_right;
+    paragraph* parent = old_paragraph->tree_parent;
+    if (child != NULL)
+    {
+        child->tree_parent = parent;
+    }
+    if (parent == NULL)
+    {
+        line_index_root = child;
+    }
+    else if (parent->tree_left == old_paragraph)
+    {
+        parent->tree_left = child;
+    }
+    else
+    {
+        parent->tree_right = child;
+    }
+}
+
+void rotate_up(paragraph* node)
+{
+    paragraph* parent = node->tree_parent;
+    paragraph* grandparent = parent->tree_parent;
+    if (parent->tree_left == node)
+    {
+        parent->tree_left = node->tree_right;
+        if (node->tree_right != NULL)
+        {
+            node->tree_right->tree_parent = parent;
+        }
+        node->tree_right = parent;
+    }
+    else
+    {
+        parent->tree_right = node->tree_left;
+        if (node->tree_left != NULL)
+        {
+            node->tree_left->tree_parent = parent;
+        }
+        node->tree_left = parent;
+    }
+    parent->tree_parent = node;
+
+    node->tree_parent = grandparent;
+    if (grandparent == NULL)
+    {
+        line_index_root = node;
+    }
+    else if (grandparent->tree_left == parent)
+    {
+        grandparent->tree_left = node;
+    }
+    else
+    {
+        grandparent->tree_right = node;
+    }
+    count_tree_lines(parent);
+    count_tree_lines(node);
+}
+
+void count_tree_lines(paragraph* node)
+{
+    node->tree_lines = node->line_count;
+    if (node->tree_left != NULL)
+    {
+        node->tree_lines += node->tree_left->tree_lines;
+    }
+    if (node->tree_right != NULL)
+    {
+        node->tree_lines += node->tree_right->tree_lines;
+    }
+}
+
+int count_lines(paragraph* current_paragraph)
+{
+    if (current_paragraph->paragraph_start == NULL)
+    {
+        return current_paragraph->source_lines;
+    }
+    // Line numbers count from the start of their paragraph, and only a paragraph buffer runs on over more than one row
+    if (!paragraph_buffers)
+    {
+        return current_paragraph->paragraph_end->line_number + 1;
+    }
+    return line_rows(current_paragraph->paragraph_end, current_paragraph->width);
+}
+
+int first_line_number(paragraph* current_paragraph)
+{
+    // Every node passed on the way up from the right adds itself and its left subtree
+    int line_number = (current_paragraph->tree_left != NULL) ? current_paragraph->tree_left->tree_lines : 0;
+    for (paragraph* node = current_paragraph; node->tree_parent != NULL; node = node->tree_parent)
+    {
+        paragraph* parent = node->tree_parent;
+        if (parent->tree_right == node)
+        {
+            line_number += parent->line_count + ((parent->tree_left != NULL) ? parent->tree_left->tree_lines : 0);
+        }
+    }
+    return line_number;
+}
+
+paragraph* find_line(int line_number)
+{
+    // Line numbers past the end of the document land on the last paragraph
+    paragraph* node = line_index_root;
+    while (node != NULL)
+    {
+        int left_lines = (node->tree_left != NULL) ? node->tree_left->tree_lines : 0;
+        if (line_number < left_lines && node->tree_left != NULL)
+        {
+            node = node->tree_left;
+        }
+        else if (line_number < left_lines + node->line_count || node->tree_right == NULL)
+        {
+            return node;
+        }
+        else
+        {
+            line_number -= left_lines + node->line_count;
+            node = node->tree_right;
+        }
+    }
+    return NULL;
+}
+
+line* copy_lines(line* current_line, paragraph* target_paragraph)
+{
+    line* target_line = target_paragraph->paragraph_end;
+
+    for (line* line_ptr = current_line; line_ptr != NULL && target_line != NULL; line_ptr = line_ptr->next_line)
+    {
+        // Only the text after the cursor moves on the first line
+        if (line_ptr != current_line)
+        {
+            target_line = append_text(target_paragraph, line_ptr->buffer, line_ptr->gap_start - line_ptr->buffer);
+        }
+        if (target_line != NULL)
+        {
+            target_line = append_text(target_paragraph, line_ptr->gap_end + 1, line_ptr->buffer_end - line_ptr->gap_end);
+        }
+    }
+    return target_line;
+}
+
+line* append_text(paragraph* target_paragraph, char* text, long length)
+{
+    line* target_line = target_paragraph->paragraph_end;
+
+    // A paragraph buffer takes the text in one copy, leaving a free character so it never fills
+    if (paragraph_buffers)
+    {
+        if (grow_line(target_line, target_line->number_characters + length + 1) != 0)
+        {
+            return NULL;
+        }
+        move_cursor_to(target_line, target_line->number_characters);
+        memcpy(target_line->gap_start, text, length);
+        target_line->number_characters += length;
+        target_line->width += text_width(text, text + length);
+        target_line->gap_start += length;
+        refit_rows(target_line, target_line->number_characters - length, 0, length);
+        fix_line_numbers(target_paragraph);
+        return target_line;
+    }
+
+    // The empty line after a full one goes, as marks coming next still fit on the full line
+    if (target_line->number_characters == 0 && target_line->previous_line != NULL)
+    {
+        line* empty_line = target_line;
+        target_line = target_line->previous_line;
+        target_line->next_line = NULL;
+        target_paragraph->paragraph_end = target_line;
+        free_line(empty_line);
+    }
+
+    // Each line takes as much of the text as fits on a row, the last one already holding some
+    move_cursor_to(target_line, target_line->number_characters);
+    char* text_end = text + length;
+    while (text < text_end)
+    {
+        int width = target_line->width;
+        char* fitted_end = fit_text(text, text_end, max_x, &width);
+        if (grow_line(target_line, target_line->number_characters + (fitted_end - text) + 1) != 0)
+        {
+            return NULL;
+        }
+        memcpy(target_line->gap_start, text, fitted_end - text);
+        target_line->number_characters += fitted_end - text;
+        target_line->gap_start += fitted_end - text;
+        target_line->width = width;
+        text = fitted_end;
+
+        if (text == text_end)
+        {
+            break;
+        }
+        target_line->next_line = add_line(target_line);
+        if (target_line->next_line == NULL)
+        {
+            return NULL;
+        }
+        target_line = target_line->next_line;
+        target_paragraph->paragraph_end = target_line;
+    }
+
+    // A full last line is followed by an empty one, for the cursor to sit on after its last character
+    if (target_line->width >= max_x)
+    {
+        target_line->next_line = add_line(target_line);
+        if (target_line->next_line == NULL)
+        {
+            return NULL;
+        }
+        target_line = target_line->next_line;
+        target_paragraph->paragraph_end = target_line;
+    }
+    fix_line_numbers(target_paragraph);
+    return target_line;
+}
+
+int wrap_lines(paragraph* current_paragraph, line* edited_line, line** cursor_line)
+{
+    // The cursor is followed as a line and offset while characters move between lines, and its gap put back at the end
+    line* cursor = *cursor_line;
+    int cursor_offset = cursor->gap_start - cursor->buffer;
+
+    // Shortening a line can let the start of it go back up onto the line before
+    line* line_ptr = (edited_line->previous_line != NULL) ? edited_line->previous_line : edited_line;
+    int edited_line_reached = 0;
+    while (line_ptr != NULL)
+    {
+        int changed = 0;
+
+        // Characters that no longer fit go onto the start of the next line, the last one first
+        while (line_overflows(line_ptr))
+        {
+            if (line_ptr->next_line == NULL)
+            {
+                line_ptr->next_line = add_line(line_ptr);
+                if (line_ptr->next_line == NULL)
+                {
+                    return 1;
+                }
+                current_paragraph->paragraph_end = line_ptr->next_line;
+            }
+            line* next_line = line_ptr->next_line;
+
+            int width;
+            int length = character_before(line_ptr, line_ptr->number_characters, &width);
+            move_cursor_to(line_ptr, line_ptr->number_characters);
+            move_cursor_to(next_line, 0);
+            if (grow_line(next_line, next_line->number_characters + length + 1) != 0)
+            {
+                return 1;
+            }
+            memcpy(next_line->gap_start, line_ptr->gap_start - length, length);
+            next_line->gap_start += length;
+            next_line->number_characters += length;
+            next_line->width += width;
+            line_ptr->gap_start -= length;
+            line_ptr->number_characters -= length;
+            line_ptr->width -= width;
+
+            if (cursor == next_line)
+            {
+                cursor_offset += length;
+            }
+            else if (cursor == line_ptr && cursor_offset >= line_ptr->number_characters)
+            {
+                cursor = next_line;
+                cursor_offset -= line_ptr->number_characters;
+            }
+            changed = 1;
+        }
+
+        // Then the start of the next line comes back up for as long as it fits, from past a line the edit left empty
+        while (1)
+        {
+            line* next_line = line_ptr->next_line;
+            while (next_line != NULL && next_line->number_characters == 0)
+            {
+                next_line = next_line->next_line;
+            }
+            if (next_line == NULL)
+            {
+                break;
+            }
+            int width;
+            int length = character_after(next_line, 0, &width);
+            if (line_ptr->width > 0 && line_ptr->width + width > max_x)
+            {
+                break;
+            }
+
+            int old_length = line_ptr->number_characters;
+            move_cursor_to(line_ptr, old_length);
+            move_cursor_to(next_line, 0);
+            if (grow_line(line_ptr, old_length + length + 1) != 0)
+            {
+                return 1;
+            }
+            memcpy(line_ptr->gap_start, next_line->gap_end + 1, length);
+            line_ptr->gap_start += length;
+            line_ptr->number_characters += length;
+            line_ptr->width += width;
+            next_line->gap_end += length;
+            next_line->number_characters -= length;
+            next_line->width -= width;
+
+            if (cursor == next_line && cursor_offset >= length)
+            {
+                cursor_offset -= length;
+            }
+            else if (cursor == next_line || cursor == line_ptr->next_line)
+            {
+                cursor = line_ptr;
+                cursor_offset += old_length;
+            }
+            changed = 1;
+        }
+
+        // Past the edited line, a line left as it was leaves every line after it as it was too
+        if (line_ptr == edited_line)
+        {
+            edited_line_reached = 1;
+        }
+        if (edited_line_reached && !changed)
+        {
+            break;
+        }
+        line_ptr = line_ptr->next_line;
+    }
+
+    // An empty last line only stays after a full one, and a full last line needs one after it
+    line* last_line = current_paragraph->paragraph_end;
+    while (last_line->number_characters == 0 && last_line->previous_line != NULL && last_line->previous_line->width < max_x)
+    {
+        line* previous_line = last_line->previous_line;
+        if (cursor == last_line)
+        {
+            cursor = previous_line;
+            cursor_offset = previous_line->number_characters;
+        }
+        previous_line->next_line = NULL;
+        current_paragraph->paragraph_end = previous_line;
+        free_line(last_line);
+        last_line = previous_line;
+    }
+    if (last_line->width >= max_x)
+    {
+        last_line->next_line = add_line(last_line);
+        if (last_line->next_line == NULL)
+        {
+            return 1;
+        }
+        current_paragraph->paragraph_end = last_line->next_line;
+    }
+
+    // The end of a line that has another after it is the start of that one
+    if (cursor_offset == cursor->number_characters && cursor->next_line != NULL)
+    {
+        cursor = cursor->next_line;
+        cursor_offset = 0;
+    }
+    move_cursor_to(cursor, cursor_offset);
+    *cursor_line = cursor;
+    fix_line_numbers(current_paragraph);
+    return 0;
+}
+
+int line_overflows(line* current_line)
+{
+    // Only a line wider than the screen can be too long
+    if (current_line->width <= max_x)
+    {
+        return 0;
+    }
+    int width;
+    return row_end(current_line, 0, max_x, &width) < current_line->number_characters;
+}
+
+long ascii_length(char* text, char* text_end)
+{
+    // Sixteen bytes at a time where SSE2 is there, since plain ASCII has no byte with its top bit set
+    char* ptr = text;
+#ifdef __SSE2__
+    while (text_end - ptr >= 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((__m128i*) ptr));
+        if (mask != 0)
+        {
+            return ptr - text + __builtin_ctz(mask);
+        }
+        ptr += 16;
+    }
+#endif
+    while (ptr < text_end && (unsigned char) *ptr < 0x80)
+    {
+        ptr++;
+    }
+    return ptr - text;
+}
+
+int decode_character(char* text, char* text_end, int* codepoint)
+{
+    // Anything that isn't the shortest UTF-8 for a character is taken a byte at a time, each an invalid character of its own
+    unsigned char* bytes = (unsigned char*) text;
+    *codepoint = -1;
+    if (bytes[0] < 0x80)
+    {
+        *codepoint = bytes[0];
+        return 1;
+    }
+
+    int length;
+    int value;
+    int minimum;
+    if (bytes[0] >= 0xc2 && bytes[0] <= 0xdf)
+    {
+        length = 2;
+        value = bytes[0] & 0x1f;
+        minimum = 0x80;
+    }
+    else if (bytes[0] >= 0xe0 && bytes[0] <= 0xef)
+    {
+        length = 3;
+        value = bytes[0] & 0x0f;
+        minimum = 0x800;
+    }
+    else if (bytes[0] >= 0xf0 && bytes[0] <= 0xf4)
+    {
+        length = 4;
+        value = bytes[0] & 0x07;
+        minimum = 0x10000;
+    }
+    else
+    {
+        return 1;
+    }
+    if (text_end - text < length)
+    {
+        return 1;
+    }
+    for (int i = 1; i < length; i++)
+    {
+        if ((bytes[i] & 0xc0) != 0x80)
+        {
+            return 1;
+        }
+        value = value << 6 | (bytes[i] & 0x3f);
+    }
+    if (value < minimum || value > 0x10ffff || (value >= 0xd800 && value <= 0xdfff))
+    {
+        return 1;
+    }
+    *codepoint = value;
+    return length;
+}
+
+int encode_character(int codepoint, char* text)
+{
+    unsigned char* bytes = (unsigned char*) text;
+    if (codepoint < 0x80)
+    {
+        bytes[0] = codepoint;
+        return 1;
+    }
+    if (codepoint < 0x800)
+    {
+        bytes[0] = 0xc0 | codepoint >> 6;
+        bytes[1] = 0x80 | (codepoint & 0x3f);
+        return 2;
+    }
+    if (codepoint < 0x10000)
+    {
+        bytes[0] = 0xe0 | codepoint >> 12;
+        bytes[1] = 0x80 | (codepoint >> 6 & 0x3f);
+        bytes[2] = 0x80 | (codepoint & 0x3f);
+        return 3;
+    }
+    bytes[0] = 0xf0 | codepoint >> 18;
+    bytes[1] = 0x80 | (codepoint >> 12 & 0x3f);
+    bytes[2] = 0x80 | (codepoint >> 6 & 0x3f);
+    bytes[3] = 0x80 | (codepoint & 0x3f);
+    return 4;
+}
+
+int character_width(int codepoint)
+{
+    // Invalid bytes and characters the locale has no width for are shown as a question mark, so take a column
+    if (codepoint < 0x80)
+    {
+        return 1;
+    }
+    int width = wcwidth(codepoint);
+    return (width < 0) ? 1 : width;
+}
+
+int next_character(char* text, char* text_end, int* width)
+{
+    int codepoint;
+    int length = decode_character(text, text_end, &codepoint);
+    *width = character_width(codepoint);
+    return length;
+}
+
+int previous_character(char* text_start, char* text, int* width)
+{
+    // Stepping back over continuation bytes to the byte that leads them, which only counts if it decodes to exactly those bytes
+    int length = 1;
+    while (length < 4 && text - length > text_start && ((unsigned char) *(text - length) & 0xc0) == 0x80)
+    {
+        length++;
+    }
+    int codepoint;
+    if (length > 1 && decode_character(text - length, text, &codepoint) == length)
+    {
+        *width = character_width(codepoint);
+        return length;
+    }
+    *width = 1;
+    return 1;
+}
+
+int text_width(char* text, char* text_end)
+{
+    int width = 0;
+    while (text < text_end)
+    {
+        long ascii = ascii_length(text, text_end);
+        width += ascii;
+        text += ascii;
+        if (text < text_end)
+        {
+            int character_columns;
+            text += next_character(text, text_end, &character_columns);
+            width += character_columns;
+        }
+    }
+    return width;
+}
+
+char* fit_text(char* text, char* text_end, int columns, int* width)
+{
+    // Adds characters to a row already holding width columns for as long as they fit, the first always fitting however wide it is
+    while (text < text_end)
+    {
+        long room = columns - *width;
+        long ascii = (room > 0) ? ascii_length(text, (text_end - text > room) ? text + room : text_end) : 0;
+        if (ascii > 0)
+        {
+            text += ascii;
+            *width += ascii;
+            continue;
+        }
+
+        // A character that takes no columns goes on the one before it, even at the end of a full row
+        int character_columns;
+        int length = next_character(text, text_end, &character_columns);
+        if (*width > 0 && *width + character_columns > columns)
+        {
+            return text;
+        }
+        text += length;
+        *width += character_columns;
+    }
+    return text;
+}
+
+int count_rows(char* text, char* text_end)
+{
+    // ASCII takes a column a byte so its rows can be worked out, anything else is fitted a row at a time
+    if (ascii_length(text, text_end) == text_end - text)
+    {
+        return (text_end - text) / max_x + 1;
+    }
+    int rows = 1;
+    while (1)
+    {
+        int width = 0;
+        char* row_text_end = fit_text(text, text_end, max_x, &width);
+        if (row_text_end == text_end)
+        {
+            // A full last row has an empty one after it, the same as a full last line
+            return (width >= max_x) ? rows + 1 : rows;
+        }
+        text = row_text_end;
+        rows++;
+    }
+}
+
+char* seek_text_row(char* text, char* text_end, int row)
+{
+    long ascii_rows = (long) row * max_x;
+    if (ascii_rows > text_end - text)
+    {
+        ascii_rows = text_end - text;
+    }
+    if (ascii_length(text, text + ascii_rows) == ascii_rows)
+    {
+        return text + ascii_rows;
+    }
+    for (int i = 0; i < row && text < text_end; i++)
+    {
+        int width = 0;
+        text = fit_text(text, text_end, max_x, &width);
+    }
+    return text;
+}
+
+void print_text(char* text, char* text_end)
+{
+    // Anything invalid or that the terminal can't show goes out as a question mark
+    while (text < text_end)
+    {
+        // A run of ASCII goes out in one call, all but a last character that marks may follow
+        long ascii = ascii_length(text, text_end);
+        if (ascii > 0 && text + ascii < text_end)
+        {
+            ascii--;
+        }
+        if (ascii > 0)
+        {
+            if (cell_renderer)
+            {
+                // Control characters would be acted on by the terminal, so they go out as the question mark their one column is kept for
+                for (long i = 0; i < ascii; i++)
+                {
+                    put_cell((text[i] < 0x20 || text[i] == 0x7f) ? "?" : text + i, 1, 1);
+                }
+            }
+            else
+            {
+                // Curses would draw a control character as ^ and a letter, or a tab as spaces to the next stop, so they go out as question marks too
+                long run_start = 0;
+                for (long i = 0; i <= ascii; i++)
+                {
+                    if (i == ascii || text[i] < 0x20 || text[i] == 0x7f)
+                    {
+                        if (i > run_start)
+                        {
+                            addnstr(text + run_start, i - run_start);
+                        }
+                        if (i < ascii)
+                        {
+                            addch('?');
+                        }
+                        run_start = i + 1;
+                    }
+                }
+            }
+            text += ascii;
+            continue;
+        }
+        char* character_start = text;
+        int codepoint;
+        int length = decode_character(text, text_end, &codepoint);
+        text += length;
+        if (codepoint == -1 || codepoint < 0x20 || codepoint == 0x7f || (codepoint >= 0x80 && wcwidth(codepoint) < 0))
+        {
+            if (cell_renderer)
+            {
+                put_cell("?", 1, 1);
+            }
+            else
+            {
+                printw("?");
+            }
+            continue;
+        }
+
+        // Marks go into the same cell as the character before them, as curses loses them after a wide character ending a row,
+        // while one left at the start by the gap goes on its own since curses only adds the first character of a cell to the last
+        wchar_t characters[CCHARW_MAX + 1];
+        int count = 0;
+        characters[count++] = codepoint;
+        int spacing = codepoint < 0x80 || wcwidth(codepoint) != 0;
+        while (spacing && text < text_end && count < CCHARW_MAX)
+        {
+            length = decode_character(text, text_end, &codepoint);
+            if (codepoint == -1 || wcwidth(codepoint) != 0)
+            {
+                break;
+            }
+            characters[count++] = codepoint;
+            text += length;
+        }
+        // The cells keep the character and its marks as the bytes they came in
+        if (cell_renderer)
+        {
+            put_cell(character_start, text - character_start, (characters[0] < 0x80) ? 1 : wcwidth(characters[0]));
+            continue;
+        }
+        characters[count] = 0;
+        cchar_t cell;
+        setcchar(&cell, characters, A_NORMAL, 0, NULL);
+        add_wch(&cell);
+    }
+}
+
+int read_character(int input)
+{
+    // The rest of a UTF-8 character's bytes follow its first straight away, and one that doesn't decode is dropped
+    char text[4];
+    text[0] = input;
+    int length = (input >= 0xf0) ? 4 : (input >= 0xe0) ? 3 : (input >= 0xc0) ? 2 : 1;
+    for (int i = 1; i < length; i++)
+    {
+        int next_input = getch();
+        if (next_input < 0x80 || next_input > 0xbf)
+        {
+            ungetch(next_input);
+            return -1;
+        }
+        text[i] = next_input;
+    }
+    int codepoint;
+    if (length == 1 || decode_character(text, text + length, &codepoint) != length)
+    {
+        return -1;
+    }
+    return codepoint;
+}
+
+long complete_length(char* text, long length)
+{
+    // Leaves off a character whose last bytes haven't been written yet
+    for (long back = 1; back <= 3 && back <= length; back++)
+    {
+        unsigned char byte = text[length - back];
+        if ((byte & 0xc0) != 0x80)
+        {
+            int expected = (byte >= 0xf0) ? 4 : (byte >= 0xe0) ? 3 : (byte >= 0xc2) ? 2 : 1;
+            return (expected > back) ? length - back : length;
+        }
+    }
+    return length;
+}
+
+int character_after(line* current_line, int offset, int* width)
+{
+    // The bytes of a character can sit either side of the gap, so up to four of them are gathered first
+    int gap_offset = current_line->gap_start - current_line->buffer;
+    char* text = (offset < gap_offset) ? current_line->buffer + offset : current_line->gap_end + 1 + offset - gap_offset;
+    if ((unsigned char) *text < 0x80)
+    {
+        *width = 1;
+        return 1;
+    }
+    char bytes[4];
+    int count = 0;
+    for (int i = offset; i < current_line->number_characters && count < 4; i++)
+    {
+        bytes[count++] = (i < gap_offset) ? current_line->buffer[i] : current_line->gap_end[1 + i - gap_offset];
+    }
+    return next_character(bytes, bytes + count, width);
+}
+
+int character_before(line* current_line, int offset, int* width)
+{
+    int gap_offset = current_line->gap_start - current_line->buffer;
+    char bytes[4];
+    int count = 0;
+    for (int i = offset - 1; i >= 0 && count < 4; i--)
+    {
+        bytes[3 - count++] = (i < gap_offset) ? current_line->buffer[i] : current_line->gap_end[1 + i - gap_offset];
+    }
+    if ((unsigned char) bytes[3] < 0x80)
+    {
+        *width = 1;
+        return 1;
+    }
+    return previous_character(bytes + 4 - count, bytes + 4, width);
+}
+
+int row_end(line* current_line, int start, int columns, int* row_width)
+{
+    // A line of single column characters is cut into rows by counting, the rest are fitted either side of the gap, which only ever sits between characters
+    if (current_line->width == current_line->number_characters)
+    {
+        int end = (start + columns < current_line->number_characters) ? start + columns : current_line->number_characters;
+        *row_width = end - start;
+        return end;
+    }
+    *row_width = 0;
+    int gap_offset = current_line->gap_start - current_line->buffer;
+    int end = start;
+    if (end < gap_offset)
+    {
+        end += fit_text(current_line->buffer + end, current_line->gap_start, columns, row_width) - (current_line->buffer + end);
+        if (end < gap_offset)
+        {
+            return end;
+        }
+    }
+    char* text = current_line->gap_end + 1 + end - gap_offset;
+    end += fit_text(text, current_line->buffer_end + 1, columns, row_width) - text;
+    return end;
+}
+
+int row_start(line* current_line, int offset, int* row)
+{
+    // The cursor after the last character of a full row is at the start of the next one
+    if (current_line->width == current_line->number_characters)
+    {
+        *row = offset / max_x;
+        return *row * max_x;
+    }
+    if (index_rows(current_line))
+    {
+        *row = find_row(current_line, offset);
+        return current_line->row_starts[*row];
+    }
+    *row = 0;
+    int start = 0;
+    while (1)
+    {
+        int width;
+        int end = row_end(current_line, start, max_x, &width);
+        if (offset < end || (end == current_line->number_characters && (offset > end || width < max_x)))
+        {
+            return start;
+        }
+        start = end;
+        (*row)++;
+    }
+}
+
+int row_last(line* current_line, int start)
+{
+    // The furthest the cursor goes along a row, which is before its last character unless nothing comes after it
+    int width;
+    int end = row_end(current_line, start, max_x, &width);
+    if (end == current_line->number_characters && width < max_x && current_line->next_line == NULL)
+    {
+        return end;
+    }
+    return (end > start) ? end - character_before(current_line, end, &width) : end;
+}
+
+int row_column(line* current_line, int start, int offset)
+{
+    if (current_line->width == current_line->number_characters)
+    {
+        return offset - start;
+    }
+    int column = 0;
+    for (int i = start; i < offset; )
+    {
+        int width;
+        i += character_after(current_line, i, &width);
+        column += width;
+    }
+    return column;
+}
+
+int column_offset(line* current_line, int start, int column)
+{
+    // The cursor lands on the last place in the row that isn't past the column
+    int last = row_last(current_line, start);
+    if (current_line->width == current_line->number_characters)
+    {
+        return (start + column < last) ? start + column : last;
+    }
+    int offset = start;
+    int offset_column = 0;
+    while (offset < last)
+    {
+        int width;
+        int length = character_after(current_line, offset, &width);
+        if (offset_column + width > column)
+        {
+            break;
+        }
+        offset += length;
+        offset_column += width;
+    }
+    return offset;
+}
+
+int line_rows(line* current_line, int columns)
+{
+    if (current_line->width == current_line->number_characters)
+    {
+        return current_line->number_characters / columns + 1;
+    }
+    // Counting a paragraph in another width, or one not yet indexed, is left to fit it without building an index
+    if (current_line->row_count > 0 && current_line->row_columns == columns)
+    {
+        return current_line->row_count;
+    }
+    int rows = 1;
+    int start = 0;
+    while (1)
+    {
+        int width;
+        int end = row_end(current_line, start, columns, &width);
+        if (end == current_line->number_characters)
+        {
+            return (width >= columns) ? rows + 1 : rows;
+        }
+        start = end;
+        rows++;
+    }
+}
+
+int seek_row(line* current_line, int row)
+{
+    if (current_line->width == current_line->number_characters)
+    {
+        return (row * max_x < current_line->number_characters) ? row * max_x : current_line->number_characters;
+    }
+    if (index_rows(current_line))
+    {
+        return (row < current_line->row_count) ? current_line->row_starts[row] : current_line->number_characters;
+    }
+    int start = 0;
+    for (int i = 0; i < row && start < current_line->number_characters; i++)
+    {
+        int width;
+        start = row_end(current_line, start, max_x, &width);
+    }
+    return start;
+}
+
+int index_rows(line* current_line)
+{
+    // Only paragraph buffers are indexed, and lines of single column characters find their rows by counting instead
+    if (!paragraph_buffers || current_line->width == current_line->number_characters)
+    {
+        drop_rows(current_line);
+        return 0;
+    }
+    if (current_line->row_count > 0 && current_line->row_columns == max_x)
+    {
+        return 1;
+    }
+
+    // A full last row is followed by an empty one starting after the last character
+    current_line->row_count = 0;
+    current_line->row_columns = max_x;
+    int start = 0;
+    while (1)
+    {
+        if (grow_rows(current_line, current_line->row_count + 1) != 0)
+        {
+            drop_rows(current_line);
+            return 0;
+        }
+        current_line->row_starts[current_line->row_count++] = start;
+
+        int width;
+        int end = row_end(current_line, start, max_x, &width);
+        if (end == current_line->number_characters && width < max_x)
+        {
+            return 1;
+        }
+        start = end;
+    }
+}
+
+int find_row(line* current_line, int offset)
+{
+    // The last row starting at or before the offset
+    int low = 0;
+    int high = current_line->row_count - 1;
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if (current_line->row_starts[middle] <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+void refit_rows(line* current_line, int offset, int removed, int added)
+{
+    if (current_line->row_count == 0)
+    {
+        return;
+    }
+    if (current_line->row_columns != max_x)
+    {
+        drop_rows(current_line);
+        return;
+    }
+
+    // The row before the one holding the edit can take a mark put at its end, so rows are fitted again from the last one starting before the edit
+    int first = find_row(current_line, offset - 1);
+    int* row_starts = current_line->row_starts;
+    int old_count = current_line->row_count;
+    int shift = added - removed;
+
+    // Once a row past the edit starts where an old one did, the rows after it are the old rows moved along by the edit
+    int rows = 0;
+    int old_row = first + 1;
+    int start = row_starts[first];
+    while (1)
+    {
+        int width;
+        int end = row_end(current_line, start, max_x, &width);
+        if (end == current_line->number_characters)
+        {
+            rows += (width >= max_x);
+            old_row = old_count;
+            break;
+        }
+        while (old_row < old_count && row_starts[old_row] + shift < end)
+        {
+            old_row++;
+        }
+        if (old_row < old_count && row_starts[old_row] + shift == end && end >= offset + added)
+        {
+            break;
+        }
+        rows++;
+        start = end;
+    }
+
+    int kept = old_count - old_row;
+    if (grow_rows(current_line, first + 1 + rows + kept) != 0)
+    {
+        drop_rows(current_line);
+        return;
+    }
+    row_starts = current_line->row_starts;
+    memmove(row_starts + first + 1 + rows, row_starts + old_row, kept * sizeof(int));
+    for (int i = first + 1 + rows; i < first + 1 + rows + kept; i++)
+    {
+        row_starts[i] += shift;
+    }
+    start = row_starts[first];
+    for (int i = first + 1; i <= first + rows; i++)
+    {
+        int width;
+        start = row_end(current_line, start, max_x, &width);
+        row_starts[i] = start;
+    }
+    current_line->row_count = first + 1 + rows + kept;
+}
+
+int grow_rows(line* current_line, int count)
+{
+    if (current_line->row_capacity >= count)
+    {
+        return 0;
+    }
+    int capacity = (current_line->row_capacity > 0) ? current_line->row_capacity * 2 : 64;
+    if (capacity < count)
+    {
+        capacity = count;
+    }
+    int* row_starts = realloc(current_line->row_starts, capacity * sizeof(int));
+    if (row_starts == NULL)
+    {
+        return 1;
+    }
+    line_memory += (capacity - current_line->row_capacity) * sizeof(int);
+    current_line->row_starts = row_starts;
+    current_line->row_capacity = capacity;
+    return 0;
+}
+
+void drop_rows(line* current_line)
+{
+    // The index only saves refitting, so a line without one finds its rows the slow way
+    line_memory -= current_line->row_capacity * sizeof(int);
+    free(current_line->row_starts);
+    current_line->row_starts = NULL;
+    current_line->row_count = 0;
+    current_line->row_capacity = 0;
+}
+
+void print_line_text(line* current_line, int start, int end)
+{
+    // A mark starting a row has nothing to go on and the terminal would put it on the row above, so it is left out
+    while (start < end)
+    {
+        int width;
+        int length = character_after(current_line, start, &width);
+        if (width != 0)
+        {
+            break;
+        }
+        start += length;
+    }
+
+    // Printed either side of the gap, the same way row_end fits it
+    int gap_offset = current_line->gap_start - current_line->buffer;
+    int before_end = (end < gap_offset) ? end : gap_offset;
+    int after_start = (start > gap_offset) ? start : gap_offset;
+
+    // Except that a character the gap parts from its marks goes out together with them, as curses can lose a mark on its own
+    char cluster[4 * CCHARW_MAX];
+    int cluster_length = 0;
+    if (start < gap_offset && gap_offset < end)
+    {
+        int width;
+        character_after(current_line, gap_offset, &width);
+        if (width == 0)
+        {
+            int count = 0;
+            do
+            {
+                before_end -= character_before(current_line, before_end, &width);
+                count++;
+            }
+            while (width == 0 && before_end > start && count < CCHARW_MAX);
+            cluster_length = gap_offset - before_end;
+            memcpy(cluster, current_line->buffer + before_end, cluster_length);
+            for ( ; after_start < end && count < CCHARW_MAX; count++)
+            {
+                int length = character_after(current_line, after_start, &width);
+                if (width != 0)
+                {
+                    break;
+                }
+                memcpy(cluster + cluster_length, current_line->gap_end + 1 + after_start - gap_offset, length);
+                cluster_length += length;
+                after_start += length;
+            }
+        }
+    }
+
+    if (start < before_end)
+    {
+        print_text(current_line->buffer + start, current_line->buffer + before_end);
+    }
+    print_text(cluster, cluster + cluster_length);
+    if (after_start < end)
+    {
+        print_text(current_line->gap_end + 1 + after_start - gap_offset, current_line->gap_end + 1 + end - gap_offset);
+    }
+}
+
+void print_lines(void)
+{
+    // Only the rows marked since the last time are drawn again, and when the view has moved the rows still on screen are scrolled to where they go
+    // A paragraph above the view wrapped again while drawing moves the view under the rows just drawn, so they are all drawn again
+    // Only wrapping a paragraph to a new width moves the view, and that happens once for each paragraph, so the passes come to an end
+    while (1)
+    {
+        if (drawn_top != -1 && display_top != drawn_top && abs(display_top - drawn_top) < view_rows)
+        {
+            int shift = display_top - drawn_top;
+            scroll_rows(shift);
+            if (shift > 0)
+            {
+                // The whole screen scrolls, so the first of the rows to draw is the one the status row went up to
+                mark_rows(display_bottom - shift + 1, display_bottom);
+            }
+            else
+            {
+                mark_rows(display_top, display_top - shift - 1);
+            }
+            drawn_top = display_top;
+        }
+        if (display_top != drawn_top)
+        {
+            mark_rows(display_top, display_bottom);
+            drawn_top = display_top;
+        }
+        int top = (dirty_top > display_top) ? dirty_top : display_top;
+        int bottom = (dirty_bottom < display_bottom) ? dirty_bottom : display_bottom;
+        dirty_top = INT_MAX;
+        dirty_bottom = -1;
+        if (top > bottom)
+        {
+            return;
+        }
+        for (int row = top; row <= bottom; row++)
+        {
+            clear_row(row - display_top);
+        }
+
+        // Starting from the paragraph holding the first row to draw rather than walking down to it
+        paragraph* para_ptr = find_line(top);
+        int first_line = first_line_number(para_ptr);
+        for (; para_ptr != NULL && first_line <= bottom; para_ptr = para_ptr->next_paragraph)
+        {
+            // Paragraphs coming on screen after a resize are wrapped to the new width first
+            if (rewrap_paragraph(para_ptr, NULL) != 0)
+            {
+                return;
+            }
+
+            // Building whichever lazy paragraph is about to come on screen
+            if (para_ptr->paragraph_start == NULL)
+            {
+                // Pieces are drawn straight from their text so they never need building
+                if (piece_table && para_ptr->packed_text == NULL)
+                {
+                    print_source(para_ptr, first_line, top, bottom);
+                    first_line += para_ptr->source_lines;
+                    continue;
+                }
+                int first_visible = (first_line > top) ? first_line : top;
+                para_ptr = build_paragraph(para_ptr, first_visible, INT_MAX);
+                if (para_ptr == NULL)
+                {
+                    return;
+                }
+                first_line = first_line_number(para_ptr);
+            }
+            if (paragraph_buffers)
+            {
+                print_rows(para_ptr->paragraph_start, first_line, top, bottom);
+                first_line += count_lines(para_ptr);
+                continue;
+            }
+            // Lines never move between paragraphs, so one still standing is walked from to the first line to draw, otherwise the nearer end is
+            line* ptr = (top - first_line > para_ptr->paragraph_end->line_number / 2) ? para_ptr->paragraph_end : para_ptr->paragraph_start;
+            if (anchor_line != NULL && anchor_paragraph == para_ptr)
+            {
+                ptr = anchor_line;
+            }
+            while (first_line + ptr->line_number < top && ptr->next_line != NULL)
+            {
+                ptr = ptr->next_line;
+            }
+            while (first_line + ptr->line_number > top && ptr->previous_line != NULL)
+            {
+                ptr = ptr->previous_line;
+            }
+            if (first_line + ptr->line_number <= top)
+            {
+                anchor_paragraph = para_ptr;
+                anchor_line = ptr;
+            }
+            for (; ptr != NULL && first_line + ptr->line_number <= bottom; ptr = ptr->next_line)
+            {
+                if (first_line + ptr->line_number >= top)
+                {
+                    move_to(first_line + ptr->line_number - display_top, 0);
+                    print_line_text(ptr, 0, ptr->number_characters);
+                }
+            }
+            first_line += count_lines(para_ptr);
+        }
+
+        if (drawn_top != -1)
+        {
+            return;
+        }
+    }
+}
+
+void print_rows(line* paragraph_line, int first_line, int top, int bottom)
+{
+    // Cutting the paragraph buffer into rows the width of the screen, starting from the first one to draw
+    int last_row = first_line + line_rows(paragraph_line, max_x) - 1;
+    if (first_line > bottom || last_row < top)
+    {
+        return;
+    }
+    int row = (top > first_line) ? top : first_line;
+    int start = seek_row(paragraph_line, row - first_line);
+    for ( ; row <= last_row && row <= bottom; row++)
+    {
+        int width;
+        int end = row_end(paragraph_line, start, max_x, &width);
+        move_to(row - display_top, 0);
+        print_line_text(paragraph_line, start, end);
+        start = end;
+    }
+}
+
+void print_source(paragraph* lazy_paragraph, int first_line, int top, int bottom)
+{
+    // Going through the paragraphs in the text the same way building them would, drawing the rows asked for
+    char* source_end;
+    char* text = piece_text(lazy_paragraph, &source_end);
+    while (text != NULL && first_line <= bottom)
+    {
+        char* newline = memchr(text, '\n', source_end - text);
+        char* text_end = (newline == NULL) ? source_end : newline;
+        int last_line = first_line + count_rows(text, text_end) - 1;
+
+        if (last_line >= top)
+        {
+            int row = (top > first_line) ? top : first_line;
+            char* row_text = seek_text_row(text, text_end, row - first_line);
+            for ( ; row <= last_line && row <= bottom; row++)
+            {
+                int width = 0;
+                char* row_text_end = fit_text(row_text, text_end, max_x, &width);
+                move_to(row - display_top, 0);
+                // A mark starting a row is left out, as in print_line_text
+                while (row_text < row_text_end)
+                {
+                    int character_columns;
+                    int length = next_character(row_text, row_text_end, &character_columns);
+                    if (character_columns != 0)
+                    {
+                        break;
+                    }
+                    row_text += length;
+                }
+                print_text(row_text, row_text_end);
+                row_text = row_text_end;
+            }
+        }
+
+        if (newline == NULL)
+        {
+            break;
+        }
+        text = newline + 1;
+        first_line = last_line + 1;
+    }
+}
+
+void mark_rows(int first_row, int last_row)
+{
+    // Rows marked between two draws are drawn as one run covering all of them
+    if (first_row < dirty_top)
+    {
+        dirty_top = first_row;
+    }
+    if (last_row > dirty_bottom)
+    {
+        dirty_bottom = last_row;
+    }
+}
+
+void draw_screen(void)
+{
+    // Keys already waiting are dealt with first, so a paste or a held key is drawn once when they run out
+    if (input_pending())
+    {
+        return;
+    }
+    print_lines();
+    print_status();
+    if (cell_renderer)
+    {
+        flush_cells();
+        return;
+    }
+    move(y, x);
+    refresh();
+}
+
+int input_pending(void)
+{
+    // Looking without waiting, and handing back whatever was there for the next getch
+    int delay = wgetdelay(stdscr);
+    timeout(0);
+    int input = getch();
+    timeout(delay);
+    if (input == ERR)
+    {
+        return 0;
+    }
+    ungetch(input);
+    return 1;
+}
+
+void move_to(int row, int column)
+{
+    if (!cell_renderer)
+    {
+        move(row, column);
+        return;
+    }
+    cell_row = row;
+    cell_column = column;
+}
+
+void scroll_rows(int shift)
+{
+    if (!cell_renderer)
+    {
+        scrollok(stdscr, true);
+        scrl(shift);
+        scrollok(stdscr, false);
+        return;
+    }
+
+    // Both grids move with the screen, so the rows that scroll into view are blank in each
+    long row_size = sizeof(screen_cell) * cell_columns;
+    int kept_rows = cell_rows - abs(shift);
+    int from_row = (shift > 0) ? shift : 0;
+    int to_row = (shift > 0) ? 0 : -shift;
+    memmove(back_cells + (long) to_row * cell_columns, back_cells + (long) from_row * cell_columns, row_size * kept_rows);
+    memmove(front_cells + (long) to_row * cell_columns, front_cells + (long) from_row * cell_columns, row_size * kept_rows);
+    int first_blank = (shift > 0) ? kept_rows : 0;
+    for (int row = first_blank; row < first_blank + abs(shift); row++)
+    {
+        clear_row(row);
+        memcpy(front_cells + (long) row * cell_columns, back_cells + (long) row * cell_columns, row_size);
+    }
+    cells_scrolled += shift;
+}
+
+void clear_row(int row)
+{
+    if (!cell_renderer)
+    {
+        move(row, 0);
+        clrtoeol();
+        return;
+    }
+    if (row < 0 || row >= cell_rows)
+    {
+        return;
+    }
+    screen_cell* cell = back_cells + (long) row * cell_columns;
+    for (int column = 0; column < cell_columns; column++)
+    {
+        cell[column].text[0] = ' ';
+        cell[column].length = 1;
+    }
+}
+
+void put_cell(char* text, int length, int width)
+{
+    if (cell_row < 0 || cell_row >= cell_rows)
+    {
+        return;
+    }
+    screen_cell* row_cells = back_cells + (long) cell_row * cell_columns;
+
+    // Marks go on the character before them, as curses puts them, and any that don't fit are dropped
+    if (width == 0)
+    {
+        if (cell_column == 0 || cell_column > cell_columns)
+        {
+            return;
+        }
+        screen_cell* cell = &row_cells[cell_column - 1];
+        if (cell->length == 0 && cell_column > 1)
+        {
+            cell--;
+        }
+        if (cell->length + length <= CELL_TEXT_SIZE)
+        {
+            memcpy(cell->text + cell->length, text, length);
+            cell->length += length;
+        }
+        return;
+    }
+
+    // Rows never run past the edge of the screen, but for a wide character on a screen one column wide
+    if (cell_column + width > cell_columns)
+    {
+        return;
+    }
+
+    // Writing over half of a wide character leaves a space in the other half, as it would on the terminal
+    screen_cell* cell = &row_cells[cell_column];
+    if (cell->length == 0 && cell_column > 0)
+    {
+        cell[-1].text[0] = ' ';
+        cell[-1].length = 1;
+    }
+    if (cell_column + width < cell_columns && cell[width].length == 0)
+    {
+        cell[width].text[0] = ' ';
+        cell[width].length = 1;
+    }
+    memcpy(cell->text, text, length);
+    cell->length = length;
+    if (width == 2)
+    {
+        cell[1].length = 0;
+    }
+    cell_column += width;
+}
+
+int clear_screen(void)
+{
+    if (!cell_renderer)
+    {
+        clear();
+        return 0;
+    }
+
+    // Curses clears the screen once at its new size, and has nothing to draw after that since everything goes through the cells
+    refresh();
+    free(back_cells);
+    free(front_cells);
+    free(frame_text);
+    cell_rows = max_y;
+    cell_columns = max_x;
+    back_cells = malloc(sizeof(screen_cell) * cell_rows * cell_columns);
+    front_cells = malloc(sizeof(screen_cell) * cell_rows * cell_columns);
+    // No frame is longer than every cell written with a move before it
+    frame_text = malloc((long) cell_rows * cell_columns * (CELL_TEXT_SIZE + 16) + 64);
+    if (!back_cells || !front_cells || !frame_text)
+    {
+        return -1;
+    }
+    for (long i = 0; i < (long) cell_rows * cell_columns; i++)
+    {
+        back_cells[i].text[0] = ' ';
+        back_cells[i].length = 1;
+        front_cells[i] = back_cells[i];
+    }
+    cells_cleared = 1;
+    return 0;
+}
+
+void flush_cells(void)
+{
+    // Room is left at the start for beginning a synchronized update, in case the frame turns out to need one
+    frame_used = 8;
+    int first_row = -1;
+    int last_row = -1;
+    if (cells_cleared)
+    {
+        add_frame_text("\x1b[H\x1b[2J", 7);
+        cells_cleared = 0;
+        terminal_row = 0;
+        terminal_column = 0;
+    }
+    // The terminal scrolls the whole screen the way the cells were scrolled, which leaves its cursor where it was
+    else if (cells_scrolled > 0)
+    {
+        frame_used += sprintf(frame_text + frame_used, (cells_scrolled == 1) ? "\x1b[S" : "\x1b[%dS", cells_scrolled);
+    }
+    else if (cells_scrolled < 0)
+    {
+        frame_used += sprintf(frame_text + frame_used, (cells_scrolled == -1) ? "\x1b[T" : "\x1b[%dT", -cells_scrolled);
+    }
+    int scrolled = (cells_scrolled != 0);
+    cells_scrolled = 0;
+
+    for (int row = 0; row < cell_rows; row++)
+    {
+        screen_cell* back_row = back_cells + (long) row * cell_columns;
+        screen_cell* front_row = front_cells + (long) row * cell_columns;
+
+        // Past the last cell of the row with anything in it the rest can be erased in one go
+        int blank_from = cell_columns;
+        while (blank_from > 0 && back_row[blank_from - 1].length == 1 && back_row[blank_from - 1].text[0] == ' ')
+        {
+            blank_from--;
+        }
+
+        for (int column = 0; column < cell_columns; column++)
+        {
+            screen_cell* back = &back_row[column];
+            screen_cell* front = &front_row[column];
+            if (back->length == front->length && memcmp(back->text, front->text, back->length) == 0)
+            {
+                continue;
+            }
+
+            // The right half of a wide character is drawn along with its left
+            if (back->length == 0)
+            {
+                *front = *back;
+                continue;
+            }
+            if (first_row == -1)
+            {
+                first_row = row;
+            }
+            last_row = row;
+
+            // A few unchanged cells are written again rather than moved over, when that takes fewer bytes
+            if (terminal_row != row || terminal_column != column)
+            {
+                int gap_length = INT_MAX;
+                if (terminal_row == row && terminal_column != -1 && terminal_column < column)
+                {
+                    gap_length = 0;
+                    for (int i = terminal_column; i < column; i++)
+                    {
+                        gap_length += back_row[i].length;
+                    }
+                }
+                if (gap_length <= 3)
+                {
+                    for (int i = terminal_column; i < column; i++)
+                    {
+                        add_frame_text(back_row[i].text, back_row[i].length);
+                    }
+                    terminal_column = column;
+                }
+                else
+                {
+                    add_frame_move(row, column);
+                }
+            }
+
+            if (column >= blank_from)
+            {
+                add_frame_text("\x1b[K", 3);
+                for (int i = column; i < cell_columns; i++)
+                {
+                    front_row[i] = back_row[i];
+                }
+                break;
+            }
+            add_frame_text(back->text, back->length);
+            *front = *back;
+            terminal_column = (column + 1 < cell_columns && back_row[column + 1].length == 0) ? column + 2 : column + 1;
+            // After the last column the terminal waits to wrap, so where its cursor is can't be relied on
+            if (terminal_column >= cell_columns)
+            {
+                terminal_column = -1;
+            }
+        }
+    }
+
+    // Terminals that know synchronized updates show a frame spanning several rows all at once, and the rest ignore the sequences around it
+    long frame_start = 8;
+    if (first_row != last_row || scrolled)
+    {
+        frame_start = 0;
+        memcpy(frame_text, "\x1b[?2026h", 8);
+    }
+    if (terminal_row != y || terminal_column != x)
+    {
+        add_frame_move(y, x);
+    }
+    if (frame_start == 0)
+    {
+        add_frame_text("\x1b[?2026l", 8);
+    }
+
+    for (long written = frame_start; written < frame_used; )
+    {
+        long result = write(STDOUT_FILENO, frame_text + written, frame_used - written);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            break;
+        }
+        written += result;
+    }
+}
+
+void add_frame_text(char* text, int length)
+{
+    memcpy(frame_text + frame_used, text, length);
+    frame_used += length;
+}
+
+void add_frame_move(int row, int column)
+{
+    // Moving along the row or the column the cursor is already on takes fewer bytes than giving both, and a step of one needs no count
+    int steps = 0;
+    char direction = 0;
+    if (terminal_row == row && terminal_column != -1 && column != 0)
+    {
+        steps = abs(column - terminal_column);
+        direction = (column > terminal_column) ? 'C' : 'D';
+    }
+    else if (terminal_column == column && terminal_row != -1)
+    {
+        steps = abs(row - terminal_row);
+        direction = (row > terminal_row) ? 'B' : 'A';
+    }
+
+    if (terminal_row == row && terminal_column != -1 && column == 0)
+    {
+        add_frame_text("\r", 1);
+    }
+    else if (steps == 1)
+    {
+        frame_used += sprintf(frame_text + frame_used, "\x1b[%c", direction);
+    }
+    else if (steps > 1)
+    {
+        frame_used += sprintf(frame_text + frame_used, "\x1b[%d%c", steps, direction);
+    }
+    // The column can be left out when it is the first
+    else if (column == 0)
+    {
+        frame_used += sprintf(frame_text + frame_used, "\x1b[%dH", row + 1);
+    }
+    else
+    {
+        frame_used += sprintf(frame_text + frame_used, "\x1b[%d;%dH", row + 1, column + 1);
+    }
+    terminal_row = row;
+    terminal_column = column;
+}
+
+void update_view(paragraph* current_paragraph, line* current_line)
+{
+    int view_size = view_rows - 1;
+    int row;
+    row_start(current_line, current_line->gap_start - current_line->buffer, &row);
+    int cursor_row = first_line_number(current_paragraph) + current_line->line_number + row;
+
+    if (cursor_row < display_top)
+    {
+        display_top = cursor_row;
+        display_bottom = display_top + view_size;
+    }
+    else if (cursor_row > display_bottom)
+    {
+        display_top = cursor_row - view_size;
+        display_bottom = cursor_row;
+    }
+}
+
+void update_cursor_position(paragraph* current_paragraph, line* current_line)
+{
+    // A paragraph buffer holds all of its rows, so the cursor's row and column are found by wrapping it up to the cursor
+    int cursor_offset = current_line->gap_start - current_line->buffer;
+    int row;
+    int start = row_start(current_line, cursor_offset, &row);
+
+    y = first_line_number(current_paragraph) + current_line->line_number + row - display_top;
+
+    // Before the marks on a character ending a full row, the cursor stays on that character
+    x = row_column(current_line, start, cursor_offset);
+    if (x >= max_x)
+    {
+        x = max_x - 1;
+    }
+}
+
+void shift_view(int first_line, int difference)
+{
+    // A paragraph above the top of the view that changes its count moves the view with it, so the screen keeps showing the same text
+    if (first_line < display_top)
+    {
+        display_top = (display_top + difference > first_line) ? display_top + difference : first_line;
+        display_bottom = display_top + view_rows - 1;
+        // The rows on screen no longer line up with the new view, so they are all drawn again rather than scrolled
+        drawn_top = -1;
+    }
+}
+
+void fix_line_numbers(paragraph* current_paragraph)
+{
+    // Line numbers inside a paragraph never change, so only its count and the counts above it in the index need updating
+    if (!line_index_ready)
+    {
+        return;
+    }
+    int difference = count_lines(current_paragraph) - current_paragraph->line_count;
+    if (difference == 0)
+    {
+        return;
+    }
+    for (paragraph* node = current_paragraph; node != NULL; node = node->tree_parent)
+    {
+        node->tree_lines += difference;
+    }
+    current_paragraph->line_count += difference;
+}
+
+long long save_document(char* filename, paragraph* paragraphs, double* seconds, int* owner_lost)
+{
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // A symbolic link is followed to the file it names, so the link stays and the file behind it is the one replaced
+    char* target_filename = realpath(filename, NULL);
+    if (target_filename == NULL)
+    {
+        target_filename = strdup(filename);
+        if (target_filename == NULL)
+        {
+            return -1;
+        }
+    }
+
+    // Writing next to the file being replaced so the rename below never crosses file systems
+    char* temp_filename = malloc(strlen(target_filename) + 8);
+    if (temp_filename == NULL)
+    {
+        free(target_filename);
+        return -1;
+    }
+    sprintf(temp_filename, "%s.XXXXXX", target_filename);
+    int temp_file = mkstemp(temp_filename);
+    if (temp_file == -1)
+    {
+        free(temp_filename);
+        free(target_filename);
+        return -1;
+    }
+
+    // mkstemp makes the file private and ours, so give it the owner and permissions the file had or would have had
+    // The owner goes first as changing it can clear set-ID bits
+    // Only root can give a file away, so anyone else saving someone else's file gets it under their own name and at least tries to keep its group
+    *owner_lost = 0;
+    struct stat file_info;
+    if (stat(target_filename, &file_info) == 0)
+    {
+        if (fchown(temp_file, file_info.st_uid, file_info.st_gid) == -1)
+        {
+            *owner_lost = (fchown(temp_file, -1, file_info.st_gid) == -1) ? 2 : 1;
+        }
+        fchmod(temp_file, file_info.st_mode & 07777);
+    }
+    else
+    {
+        mode_t file_mask = umask(0);
+        umask(file_mask);
+        fchmod(temp_file, 0666 & ~file_mask);
+    }
+
+    long long written = -1;
+    FILE* write_file = fdopen(temp_file, "w");
+    if (write_file == NULL)
+    {
+        close(temp_file);
+    }
+    else
+    {
+        written = write_paragraphs(paragraphs, write_file);
+        if (written != -1 && (fflush(write_file) != 0 || fsync(temp_file) != 0))
+        {
+            written = -1;
+        }
+        if (fclose(write_file) != 0)
+        {
+            written = -1;
+        }
+    }
+
+    // The original is only replaced once the new text is safely on disk
+    if (written == -1 || rename(temp_filename, target_filename) != 0)
+    {
+        unlink(temp_filename);
+        free(temp_filename);
+        free(target_filename);
+        return -1;
+    }
+    free(temp_filename);
+
+    // Making the rename itself survive a crash
+    char* slash = strrchr(target_filename, '/');
+    char* directory_name = (slash == NULL) ? strdup(".") : strndup(target_filename, (slash == target_filename) ? 1 : slash - target_filename);
+    if (directory_name != NULL)
+    {
+        int directory = open(directory_name, O_RDONLY | O_DIRECTORY);
+        if (directory != -1)
+        {
+            fsync(directory);
+            close(directory);
+        }
+        free(directory_name);
+    }
+    free(target_filename);
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    *seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    return written;
+}
+
+int start_background_save(char* filename, paragraph* paragraphs)
+{
+    int progress_pipe[2];
+    if (pipe(progress_pipe) == -1)
+    {
+        return 1;
+    }
+    fcntl(progress_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(progress_pipe[1], F_SETFL, O_NONBLOCK);
+
+    // The child gets a copy-on-write snapshot of the whole document for free, so editing carries on untouched
+    pid_t child = fork();
+    if (child == -1)
+    {
+        close(progress_pipe[0]);
+        close(progress_pipe[1]);
+        return 1;
+    }
+    if (child == 0)
+    {
+        close(progress_pipe[0]);
+        save_progress_fd = progress_pipe[1];
+
+        send_progress(0, document_size(paragraphs));
+
+        // The exit status tells the editor whether the save failed, or worked but could not keep the file's owner
+        double seconds = 0;
+        int owner_lost = 0;
+        if (save_document(filename, paragraphs, &seconds, &owner_lost) == -1)
+        {
+            _exit(1);
+        }
+        _exit(owner_lost ? 2 : 0);
+    }
+
+    close(progress_pipe[1]);
+    save_process = child;
+    save_journal_records = journal_records;
+    save_progress_pipe = progress_pipe[0];
+    clock_gettime(CLOCK_MONOTONIC, &save_start_time);
+    snprintf(save_status, sizeof(save_status), "%24s", "Saving 0%");
+
+    // getch stops blocking so the progress can be redrawn while no keys come in
+    timeout(SAVE_STATUS_INTERVAL);
+    return 0;
+}
+
+void check_background_save(char* filename)
+{
+    static long long progress[2] = {0, 0};
+    long long message[2];
+    ssize_t result;
+    while ((result = read(save_progress_pipe, message, sizeof(message))) == sizeof(message))
+    {
+        // Only the first message carries the total size
+        progress[0] = message[0];
+        if (message[1] != -1)
+        {
+            progress[1] = message[1];
+        }
+    }
+
+    // The pipe only closes once the child has exited
+    if (result != 0)
+    {
+        int percent = (progress[1] > 0) ? progress[0] * 100 / progress[1] : 0;
+        char message_text[32];
+        snprintf(message_text, sizeof(message_text), "Saving %d%%", percent);
+        snprintf(save_status, sizeof(save_status), "%24s", message_text);
+        return;
+    }
+
+    int status = 0;
+    waitpid(save_process, &status, 0);
+    close(save_progress_pipe);
+    save_process = 0;
+    save_progress_pipe = -1;
+    timeout(-1);
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double milliseconds = (end_time.tv_sec - save_start_time.tv_sec) * 1000.0 + (end_time.tv_nsec - save_start_time.tv_nsec) / 1e6;
+
+    if (WIFEXITED(status) && (WEXITSTATUS(status) == 0 || WEXITSTATUS(status) == 2))
+    {
+        rebase_journal(filename, save_journal_records);
+        refresh_index(filename);
+
+        char message_text[32];
+        if (WEXITSTATUS(status) == 2)
+        {
+            snprintf(message_text, sizeof(message_text), "Saved, owner not kept");
+        }
+        else
+        {
+            snprintf(message_text, sizeof(message_text), "Saved %.1f MB in %.0f ms", progress[1] / 1e6, milliseconds);
+        }
+        snprintf(save_status, sizeof(save_status), "%24s", message_text);
+    }
+    else
+    {
+        snprintf(save_status, sizeof(save_status), "%24s", "Save failed");
+    }
+    progress[0] = 0;
+    progress[1] = 0;
+}
+
+long long document_size(paragraph* paragraphs)
+{
+    long long size = 0;
+    for (paragraph* para_ptr = paragraphs; para_ptr != NULL; para_ptr = para_ptr->next_paragraph)
+    {
+        if (para_ptr->packed_text != NULL)
+        {
+            size += para_ptr->unpacked_size;
+        }
+        else if (para_ptr->paragraph_start == NULL && para_ptr->spans == NULL)
+        {
+            size += para_ptr->source_end - para_ptr->source_start;
+        }
+        else if (para_ptr->paragraph_start == NULL)
+        {
+            for (int i = 0; i < para_ptr->span_count; i++)
+            {
+                size += para_ptr->spans[i].length;
+            }
+        }
+        for (line* ptr = para_ptr->paragraph_start; ptr != NULL; ptr = ptr->next_line)
+        {
+            size += ptr->number_characters;
+        }
+        if (para_ptr->next_paragraph != NULL)
+        {
+            size++;
+        }
+    }
+    return size;
+}
+
+long long write_paragraphs(paragraph* paragraphs, FILE* write_file)
+{
+    save_buffer buffer;
+    buffer.text = malloc(SAVE_BUFFER_SIZE);
+    if (buffer.text == NULL)
+    {
+        return -1;
+    }
+    buffer.used = 0;
+    buffer.written = 0;
+    buffer.failed = 0;
+    buffer.write_file = write_file;
+
+    char enter = '\n';
+    for (paragraph* para_ptr = paragraphs; para_ptr != NULL && !buffer.failed; para_ptr = para_ptr->next_paragraph)
+    {
+        // Packed text is unpacked into scratch to be written, and lazy text is written straight from the file or the add buffer
+        if (para_ptr->packed_text != NULL)
+        {
+            char* text = pack_scratch(para_ptr->unpacked_size);
+            if (text == NULL)
+            {
+                buffer.failed = 1;
+                break;
+            }
+            unpack_text(para_ptr->packed_text, para_ptr->packed_size, text);
+            save_span(&buffer, text, para_ptr->unpacked_size);
+        }
+        else if (para_ptr->paragraph_start == NULL && para_ptr->spans == NULL)
+        {
+            save_span(&buffer, para_ptr->source_start, para_ptr->source_end - para_ptr->source_start);
+        }
+        else if (para_ptr->paragraph_start == NULL)
+        {
+            for (int i = 0; i < para_ptr->span_count; i++)
+            {
+                save_span(&buffer, para_ptr->spans[i].text, para_ptr->spans[i].length);
+            }
+        }
+
+        // Each line is at most the text before the gap and the text after it
+        for (line* ptr = para_ptr->paragraph_start; ptr != NULL; ptr = ptr->next_line)
+        {
+            save_span(&buffer, ptr->buffer, ptr->gap_start - ptr->buffer);
+            save_span(&buffer, ptr->gap_end + 1, ptr->buffer_end - ptr->gap_end);
+        }
+
+        if (para_ptr->next_paragraph != NULL)
+        {
+            save_span(&buffer, &enter, 1);
+        }
+    }
+    flush_save_buffer(&buffer);
+
+    free(buffer.text);
+    return (buffer.failed) ? -1 : buffer.written;
+}
+
+void save_span(save_buffer* buffer, char* text, long length)
+{
+    if (buffer->used + length > SAVE_BUFFER_SIZE)
+    {
+        flush_save_buffer(buffer);
+    }
+
+    // Anything too big to stage is written straight from where it is
+    if (length > SAVE_BUFFER_SIZE)
+    {
+        if (!buffer->failed && fwrite(text, 1, length, buffer->write_file) != (size_t) length)
+        {
+            buffer->failed = 1;
+        }
+        buffer->written += length;
+        return;
+    }
+
+    memcpy(buffer->text + buffer->used, text, length);
+    buffer->used += length;
+}
+
+void flush_save_buffer(save_buffer* buffer)
+{
+    if (!buffer->failed && buffer->used > 0 && fwrite(buffer->text, 1, buffer->used, buffer->write_file) != (size_t) buffer->used)
+    {
+        buffer->failed = 1;
+    }
+    buffer->written += buffer->used;
+    buffer->used = 0;
+
+    // A background save reports how far it has got
+    if (save_progress_fd != -1)
+    {
+        send_progress(buffer->written, -1);
+    }
+}
+
+void send_progress(long long done, long long total)
+{
+    long long progress[2] = {done, total};
+    long result;
+    do
+    {
+        result = write(save_progress_fd, progress, sizeof(progress));
+    }
+    while (result == -1 && errno == EINTR);
+
+    // A report this small goes into the pipe whole or not at all, so a full pipe only drops this one while nobody is reading them yet
+    // Anything else stops the reports, leaving the pipe open as its end is how the editor learns the save has finished
+    if (result != sizeof(progress) && !(result == -1 && errno == EAGAIN))
+    {
+        save_progress_fd = -1;
+    }
+}
+
+paragraph* load_paragraphs(int read_file, paragraph* paragraphs)
+{
+    struct stat file_info;
+    if (fstat(read_file, &file_info) == -1)
+    {
+        return NULL;
+    }
+    // mmap refuses empty files, and there is nothing to build anyway
+    if (file_info.st_size == 0)
+    {
+        return paragraphs;
+    }
+
+    char* file_start = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, read_file, 0);
+    if (file_start == MAP_FAILED)
+    {
+        return NULL;
+    }
+    madvise(file_start, file_info.st_size, MADV_SEQUENTIAL);
+    char* file_end = file_start + file_info.st_size;
+
+    // Cutting the file into one chunk per core, each ending on a new line
+    long chunk_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (chunk_count > file_info.st_size / LOAD_CHUNK_SIZE)
+    {
+        chunk_count = file_info.st_size / LOAD_CHUNK_SIZE;
+    }
+    if (chunk_count > MAX_LOAD_CHUNKS)
+    {
+        chunk_count = MAX_LOAD_CHUNKS;
+    }
+    if (chunk_count < 1)
+    {
+        chunk_count = 1;
+    }
+
+    load_chunk chunks[MAX_LOAD_CHUNKS];
+    int chunks_used = 0;
+    for (char* text = file_start; chunks_used < chunk_count; text = chunks[chunks_used - 1].text_end + 1)
+    {
+        char* text_end = file_end;
+        char* split_point = file_start + file_info.st_size / chunk_count * (chunks_used + 1);
+        if (split_point < text)
+        {
+            split_point = text;
+        }
+        if (chunks_used < chunk_count - 1)
+        {
+            char* newline = memchr(split_point, '\n', file_end - split_point);
+            if (newline != NULL)
+            {
+                text_end = newline;
+            }
+        }
+        chunks[chunks_used].text = text;
+        chunks[chunks_used].text_end = text_end;
+        chunks[chunks_used].first_paragraph = NULL;
+        chunks[chunks_used].last_paragraph = NULL;
+        chunks_used++;
+
+        if (text_end == file_end)
+        {
+            break;
+        }
+    }
+
+    // The first chunk goes straight into the document on this thread while the rest are built alongside it
+    int failed = 0;
+    for (int i = 1; i < chunks_used; i++)
+    {
+        if (pthread_create(&chunks[i].thread, NULL, build_chunk, &chunks[i]) != 0)
+        {
+            build_chunk(&chunks[i]);
+            chunks[i].thread = pthread_self();
+        }
+    }
+    chunks[0].first_paragraph = paragraphs;
+    chunks[0].last_paragraph = build_paragraphs(paragraphs, chunks[0].text, chunks[0].text_end);
+    for (int i = 1; i < chunks_used; i++)
+    {
+        if (!pthread_equal(chunks[i].thread, pthread_self()))
+        {
+            pthread_join(chunks[i].thread, NULL);
+        }
+    }
+    for (int i = 1; i < chunks_used; i++)
+    {
+        pool_merge(&line_pool, &chunks[i].line_pool);
+        pool_merge(&paragraph_pool, &chunks[i].paragraph_pool);
+        line_memory += chunks[i].line_memory;
+        for (int j = 0; j < LINE_BUFFER_CLASSES; j++)
+        {
+            pool_merge(&buffer_pools[j], &chunks[i].buffer_pools[j]);
+        }
+    }
+    for (int i = 0; i < chunks_used; i++)
+    {
+        if (chunks[i].last_paragraph == NULL)
+        {
+            failed = 1;
+        }
+    }
+    if (failed)
+    {
+        munmap(file_start, file_info.st_size);
+        return NULL;
+    }
+
+    // Splicing the chunks together, their line numbers already count from the start of each paragraph
+    for (int i = 1; i < chunks_used; i++)
+    {
+        chunks[i - 1].last_paragraph->next_paragraph = chunks[i].first_paragraph;
+        chunks[i].first_paragraph->previous_paragraph = chunks[i - 1].last_paragraph;
+    }
+
+    munmap(file_start, file_info.st_size);
+    return chunks[chunks_used - 1].last_paragraph;
+}
+
+paragraph* build_paragraphs(paragraph* current_paragraph, char* text, char* text_end)
+{
+    // Finding each new line with memchr so the whole paragraph between them can be copied as one block
+    while (text < text_end)
+    {
+        char* newline = memchr(text, '\n', text_end - text);
+        char* paragraph_text_end = (newline == NULL) ? text_end : newline;
+
+        if (append_text(current_paragraph, text, paragraph_text_end - text) == NULL)
+        {
+            return NULL;
+        }
+        text = paragraph_text_end;
+
+        // Preserving the structure of each 'line' in the original file
+        if (newline != NULL)
+        {
+            current_paragraph->next_paragraph = add_paragraph(current_paragraph);
+            if (current_paragraph->next_paragraph == NULL)
+            {
+                return NULL;
+            }
+            current_paragraph = current_paragraph->next_paragraph;
+            text = newline + 1;
+        }
+    }
+    return current_paragraph;
+}
+
+void* build_chunk(void* argument)
+{
+    load_chunk* chunk = argument;
+
+    chunk->first_paragraph = add_paragraph(NULL);
+    if (chunk->first_paragraph != NULL)
+    {
+        chunk->last_paragraph = build_paragraphs(chunk->first_paragraph, chunk->text, chunk->text_end);
+    }
+
+    // The pools die with the thread, so what they hold is passed back through the chunk
+    chunk->line_pool = line_pool;
+    chunk->paragraph_pool = paragraph_pool;
+    memcpy(chunk->buffer_pools, buffer_pools, sizeof(buffer_pools));
+    chunk->line_memory = line_memory;
+    line_memory = 0;
+    memset(&line_pool, 0, sizeof(pool));
+    memset(&paragraph_pool, 0, sizeof(pool));
+    memset(buffer_pools, 0, sizeof(buffer_pools));
+    return NULL;
+}
+
+paragraph* index_paragraphs(int read_file, char* filename, paragraph* paragraphs)
+{
+    struct stat file_info;
+    if (fstat(read_file, &file_info) == -1)
+    {
+        return NULL;
+    }
+    if (file_info.st_size == 0)
+    {
+        return paragraphs;
+    }
+
+    // The mapping stays open for as long as lazy paragraphs point into it
+    file_map = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, read_file, 0);
+    if (file_map == MAP_FAILED)
+    {
+        file_map = NULL;
+        return NULL;
+    }
+    file_map_size = file_info.st_size;
+    char* file_end = file_map + file_map_size;
+
+    // The first paragraph is always built so the head of the list never moves
+    char* newline = memchr(file_map, '\n', file_map_size);
+    char* text_end = (newline == NULL) ? file_end : newline;
+    if (append_text(paragraphs, file_map, text_end - file_map) == NULL)
+    {
+        return NULL;
+    }
+    if (newline == NULL)
+    {
+        return paragraphs;
+    }
+
+    // An index left by an earlier open of the same file already has the counts for every block
+    if (index_cache)
+    {
+        index_filename = malloc(strlen(filename) + 7);
+        if (index_filename == NULL)
+        {
+            return NULL;
+        }
+        sprintf(index_filename, "%s.index", filename);
+
+        paragraph* last_paragraph = read_index(&file_info, paragraphs, newline + 1);
+        if (last_paragraph != paragraphs)
+        {
+            return last_paragraph;
+        }
+    }
+
+    // Everything else is only counted, in blocks that end on a new line
+    paragraph* current_paragraph = paragraphs;
+    for (char* text = newline + 1; ; text = text_end + 1)
+    {
+        text_end = file_end;
+        if (file_end - text > LAZY_BLOCK_SIZE)
+        {
+            newline = memchr(text + LAZY_BLOCK_SIZE, '\n', file_end - text - LAZY_BLOCK_SIZE);
+            if (newline != NULL)
+            {
+                text_end = newline;
+            }
+        }
+
+        int source_paragraphs;
+        int source_lines;
+        count_paragraphs(text, text_end, &source_paragraphs, &source_lines);
+        current_paragraph->next_paragraph = add_lazy_paragraph(current_paragraph, text, text_end, source_paragraphs, source_lines);
+        if (current_paragraph->next_paragraph == NULL)
+        {
+            return NULL;
+        }
+        current_paragraph = current_paragraph->next_paragraph;
+
+        if (text_end == file_end)
+        {
+            break;
+        }
+    }
+
+    if (index_cache)
+    {
+        write_index(&file_info, paragraphs);
+    }
+    return current_paragraph;
+}
+
+paragraph* read_index(struct stat* file_info, paragraph* current_paragraph, char* text)
+{
+    // Anything wrong with the index leaves current_paragraph as it was so the file is counted instead
+    int index_file = open(index_filename, O_RDONLY);
+    if (index_file == -1)
+    {
+        return current_paragraph;
+    }
+    struct stat index_info;
+    if (fstat(index_file, &index_info) == -1 || index_info.st_size < (off_t) sizeof(index_header))
+    {
+        close(index_file);
+        return current_paragraph;
+    }
+    char* index_map = mmap(NULL, index_info.st_size, PROT_READ, MAP_PRIVATE, index_file, 0);
+    close(index_file);
+    if (index_map == MAP_FAILED)
+    {
+        return current_paragraph;
+    }
+
+    // The index only stands in for counting if it was made from this version of the file at this width
+    index_header* header = (index_header*) index_map;
+    index_block* blocks = (index_block*) (index_map + sizeof(index_header));
+    index_header expected_header;
+    fill_index_header(&expected_header, file_info);
+    expected_header.block_count = header->block_count;
+    int valid = (memcmp(header, &expected_header, sizeof(index_header)) == 0 && header->block_count > 0);
+    valid = valid && index_info.st_size == (off_t) (sizeof(index_header) + header->block_count * sizeof(index_block));
+
+    // The blocks also have to cover the file after the first paragraph without gaps, one new line apart
+    long long expected_start = text - file_map;
+    for (int i = 0; valid && i < header->block_count; i++)
+    {
+        valid = (blocks[i].source_start == expected_start && blocks[i].source_end >= blocks[i].source_start && blocks[i].source_end <= file_map_size);
+        valid = valid && blocks[i].source_paragraphs > 0 && blocks[i].source_lines >= blocks[i].source_paragraphs;
+        expected_start = blocks[i].source_end + 1;
+    }
+    if (!valid || expected_start != file_map_size + 1)
+    {
+        munmap(index_map, index_info.st_size);
+        return current_paragraph;
+    }
+
+    for (int i = 0; i < header->block_count; i++)
+    {
+        current_paragraph->next_paragraph = add_lazy_paragraph(current_paragraph, file_map + blocks[i].source_start, file_map + blocks[i].source_end, blocks[i].source_paragraphs, blocks[i].source_lines);
+        if (current_paragraph->next_paragraph == NULL)
+        {
+            munmap(index_map, index_info.st_size);
+            return NULL;
+        }
+        current_paragraph = current_paragraph->next_paragraph;
+    }
+    munmap(index_map, index_info.st_size);
+    index_current = 1;
+    return current_paragraph;
+}
+
+void write_index(struct stat* file_info, paragraph* paragraphs)
+{
+    index_header header;
+    fill_index_header(&header, file_info);
+    for (paragraph* para_ptr = paragraphs->next_paragraph; para_ptr != NULL; para_ptr = para_ptr->next_paragraph)
+    {
+        header.block_count++;
+    }
+
+    // The index is only a cache, so failing to write it just means counting again next time
+    char* temp_filename = malloc(strlen(index_filename) + 8);
+    if (temp_filename == NULL)
+    {
+        return;
+    }
+    sprintf(temp_filename, "%s.XXXXXX", index_filename);
+    int temp_file = mkstemp(temp_filename);
+    if (temp_file == -1)
+    {
+        free(temp_filename);
+        return;
+    }
+    FILE* write_file = fdopen(temp_file, "w");
+    if (write_file == NULL)
+    {
+        close(temp_file);
+        unlink(temp_filename);
+        free(temp_filename);
+        return;
+    }
+
+    int failed = (fwrite(&header, sizeof(header), 1, write_file) != 1);
+    for (paragraph* para_ptr = paragraphs->next_paragraph; para_ptr != NULL && !failed; para_ptr = para_ptr->next_paragraph)
+    {
+        index_block block;
+        block.source_start = para_ptr->source_start - file_map;
+        block.source_end = para_ptr->source_end - file_map;
+        block.source_paragraphs = para_ptr->source_paragraphs;
+        block.source_lines = para_ptr->source_lines;
+        failed = (fwrite(&block, sizeof(block), 1, write_file) != 1);
+    }
+
+    // Renaming into place so another open never sees half an index
+    if (fclose(write_file) != 0 || failed || rename(temp_filename, index_filename) != 0)
+    {
+        unlink(temp_filename);
+    }
+    else
+    {
+        index_current = 1;
+    }
+    free(temp_filename);
+}
+
+void refresh_index(char* filename)
+{
+    // Saving an unedited document writes the same bytes back, so only the modification time in the index is out of date
+    if (!index_current || document_edited)
+    {
+        return;
+    }
+    int index_file = open(index_filename, O_RDWR);
+    if (index_file == -1)
+    {
+        return;
+    }
+    index_header header;
+    struct stat file_info;
+    if (pread(index_file, &header, sizeof(header), 0) == sizeof(header) && stat(filename, &file_info) == 0 && header.file_size == file_info.st_size)
+    {
+        header.file_modified_seconds = file_info.st_mtim.tv_sec;
+        header.file_modified_nanoseconds = file_info.st_mtim.tv_nsec;
+        if (pwrite(index_file, &header, sizeof(header), 0) != sizeof(header))
+        {
+            index_current = 0;
+        }
+    }
+    close(index_file);
+}
+
+void fill_index_header(index_header* header, struct stat* file_info)
+{
+    memset(header, 0, sizeof(index_header));
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->file_size = file_info->st_size;
+    header->file_modified_seconds = file_info->st_mtim.tv_sec;
+    header->file_modified_nanoseconds = file_info->st_mtim.tv_nsec;
+    header->sample_hash = sample_hash(file_map, file_map_size);
+    header->width = max_x;
+}
+
+unsigned long long sample_hash(char* text, long long length)
+{
+    // FNV-1a over the start of every stride and the end of the text
+    unsigned long long hash = 14695981039346656037ULL;
+    for (long long sample = 0; sample < length; sample += INDEX_SAMPLE_STRIDE)
+    {
+        long long sample_end = (length - sample > INDEX_SAMPLE_SIZE) ? sample + INDEX_SAMPLE_SIZE : length;
+        for (long long i = sample; i < sample_end; i++)
+        {
+            hash = (hash ^ (unsigned char) text[i]) * 1099511628211ULL;
+        }
+    }
+    for (long long i = (length > INDEX_SAMPLE_SIZE) ? length - INDEX_SAMPLE_SIZE : 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char) text[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void print_status(void)
+{
+    // The status row is cleared every time, as scrolling moves rows of text onto it and a message going leaves it blank
+    if (view_rows < max_y)
+    {
+        clear_row(max_y - 1);
+    }
+    if (save_status[0] == '\0')
+    {
+        return;
+    }
+    int column = max_x - (int) strlen(save_status) - 1;
+    move_to(max_y - 1, (column > 0) ? column : 0);
+    print_text(save_status, save_status + strlen(save_status));
+}
+
+int open_journal(char* filename, paragraph** cursor_paragraph, line** cursor_line)
+{
+    journal_filename = malloc(strlen(filename) + 9);
+    if (journal_filename == NULL)
+    {
+        return 0;
+    }
+    sprintf(journal_filename, "%s.journal", filename);
+
+    journal_header header;
+    read_journal_header(filename, &header);
+
+    journal_file = open(journal_filename, O_RDWR);
+    if (journal_file != -1)
+    {
+        journal_header saved_header;
+        if (read(journal_file, &saved_header, sizeof(saved_header)) == sizeof(saved_header) && memcmp(&saved_header, &header, sizeof(header)) == 0)
+        {
+            return replay_journal(cursor_paragraph, cursor_line);
+        }
+
+        // A journal for some other version of the file is put to one side rather than replayed onto the wrong text
+        close(journal_file);
+        char* old_filename = malloc(strlen(journal_filename) + 5);
+        if (old_filename != NULL)
+        {
+            sprintf(old_filename, "%s.old", journal_filename);
+            rename(journal_filename, old_filename);
+            free(old_filename);
+        }
+    }
+
+    // Editing carries on without a journal if one can't be made
+    journal_records = 0;
+    journal_file = open(journal_filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (journal_file != -1 && write(journal_file, &header, sizeof(header)) != sizeof(header))
+    {
+        close(journal_file);
+        unlink(journal_filename);
+        journal_file = -1;
+    }
+    return 0;
+}
+
+int replay_journal(paragraph** cursor_paragraph, line** cursor_line)
+{
+    journal_record* records = malloc(sizeof(journal_record) * JOURNAL_READ_RECORDS);
+    if (records == NULL)
+    {
+        return 1;
+    }
+
+    journal_records = 0;
+    ssize_t result;
+    while ((result = read(journal_file, records, sizeof(journal_record) * JOURNAL_READ_RECORDS)) > 0)
+    {
+        for (int i = 0; i < result / (ssize_t) sizeof(journal_record); i++)
+        {
+            // Putting the cursor back where the edit was made and making it again
+            paragraph* current_paragraph = seek_paragraph(*cursor_paragraph, records[i].paragraph_index);
+            if (current_paragraph == NULL || build_neighbours(current_paragraph) != 0)
+            {
+                free(records);
+                return 1;
+            }
+            line* current_line = seek_offset(current_paragraph, records[i].offset);
+            if (current_line == NULL || edit_at_cursor(records[i].input, &current_paragraph, &current_line) != 0)
+            {
+                free(records);
+                return 1;
+            }
+            *cursor_paragraph = current_paragraph;
+            *cursor_line = current_line;
+            journal_records++;
+        }
+
+        // Anything after a half written record was never written at all
+        if (result % sizeof(journal_record) != 0)
+        {
+            break;
+        }
+    }
+    free(records);
+
+    // Dropping the half written record so new ones line up after the last good one
+    off_t journal_end = sizeof(journal_header) + journal_records * sizeof(journal_record);
+    if (ftruncate(journal_file, journal_end) != 0 || lseek(journal_file, journal_end, SEEK_SET) == -1)
+    {
+        close(journal_file);
+        journal_file = -1;
+    }
+    return 0;
+}
+
+void journal_edit(int input, paragraph* current_paragraph, line* current_line)
+{
+    if (journal_file == -1)
+    {
+        return;
+    }
+    if (paragraph_index == -1)
+    {
+        paragraph_index = 0;
+        for (paragraph* para_ptr = current_paragraph->previous_paragraph; para_ptr != NULL; para_ptr = para_ptr->previous_paragraph)
+        {
+            paragraph_index += (para_ptr->paragraph_start == NULL) ? para_ptr->source_paragraphs : 1;
+        }
+    }
+
+    journal_record record;
+    record.input = input;
+    record.paragraph_index = paragraph_index;
+    record.offset = paragraph_offset(current_line);
+    if (input == 10)
+    {
+        record.operation = JOURNAL_SPLIT;
+    }
+    else if (input == 127)
+    {
+        record.operation = (record.offset == 0 && paragraph_index > 0) ? JOURNAL_MERGE : JOURNAL_DELETE;
+    }
+    else
+    {
+        record.operation = JOURNAL_INSERT;
+    }
+
+    if (write(journal_file, &record, sizeof(record)) == sizeof(record))
+    {
+        journal_records++;
+        return;
+    }
+
+    // A short write would leave every later record out of line, so cut it off
+    off_t journal_end = sizeof(journal_header) + journal_records * sizeof(journal_record);
+    if (ftruncate(journal_file, journal_end) != 0 || lseek(journal_file, journal_end, SEEK_SET) == -1)
+    {
+        close(journal_file);
+        journal_file = -1;
+    }
+}
+
+void rebase_journal(char* filename, long long snapshot_records)
+{
+    if (journal_file == -1)
+    {
+        return;
+    }
+
+    // The saved file already holds every edit up to the snapshot, so only the ones made since are kept
+    char* temp_filename = malloc(strlen(journal_filename) + 8);
+    journal_record* records = malloc(sizeof(journal_record) * JOURNAL_READ_RECORDS);
+    if (temp_filename == NULL || records == NULL)
+    {
+        free(temp_filename);
+        free(records);
+        return;
+    }
+    sprintf(temp_filename, "%s.XXXXXX", journal_filename);
+    int new_journal = mkstemp(temp_filename);
+    if (new_journal == -1)
+    {
+        free(temp_filename);
+        free(records);
+        return;
+    }
+
+    journal_header header;
+    read_journal_header(filename, &header);
+    int failed = (write(new_journal, &header, sizeof(header)) != sizeof(header));
+
+    off_t read_offset = sizeof(journal_header) + snapshot_records * sizeof(journal_record);
+    ssize_t result;
+    while (!failed && (result = pread(journal_file, records, sizeof(journal_record) * JOURNAL_READ_RECORDS, read_offset)) > 0)
+    {
+        failed = (write(new_journal, records, result) != result);
+        read_offset += result;
+    }
+
+    if (failed || rename(temp_filename, journal_filename) != 0)
+    {
+        close(new_journal);
+        unlink(temp_filename);
+    }
+    else
+    {
+        close(journal_file);
+        journal_file = new_journal;
+        journal_records -= snapshot_records;
+    }
+    free(temp_filename);
+    free(records);
+}
+
+void close_journal(int remove_journal)
+{
+    if (journal_file != -1)
+    {
+        close(journal_file);
+        journal_file = -1;
+        if (remove_journal)
+        {
+            unlink(journal_filename);
+        }
+    }
+    free(journal_filename);
+    journal_filename = NULL;
+}
+
+void read_journal_header(char* filename, journal_header* header)
+{
+    memset(header, 0, sizeof(journal_header));
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+
+    // The size and modification time tell whether the file is still the one the edits were made to
+    struct stat file_info;
+    if (stat(filename, &file_info) == 0)
+    {
+        header->file_size = file_info.st_size;
+        header->file_modified_seconds = file_info.st_mtim.tv_sec;
+        header->file_modified_nanoseconds = file_info.st_mtim.tv_nsec;
+    }
+    else
+    {
+        header->file_size = -1;
+    }
+}
+
+void step_paragraph_index(int step)
+{
+    if (paragraph_index != -1)
+    {
+        paragraph_index += step;
+    }
+}
+
+paragraph* seek_paragraph(paragraph* current_paragraph, int target_index)
+{
+    if (paragraph_index == -1)
+    {
+        paragraph_index = 0;
+        for (paragraph* para_ptr = current_paragraph->previous_paragraph; para_ptr != NULL; para_ptr = para_ptr->previous_paragraph)
+        {
+            paragraph_index += (para_ptr->paragraph_start == NULL) ? para_ptr->source_paragraphs : 1;
+        }
+    }
+
+    // Lazy paragraphs on the way are stepped over whole, only building the one the target is in
+    while (paragraph_index < target_index)
+    {
+        paragraph* next_paragraph = current_paragraph->next_paragraph;
+        if (next_paragraph == NULL)
+        {
+            return NULL;
+        }
+        if (next_paragraph->paragraph_start == NULL)
+        {
+            int index = target_index - paragraph_index - 1;
+            if (index >= next_paragraph->source_paragraphs)
+            {
+                index = next_paragraph->source_paragraphs - 1;
+            }
+            next_paragraph = build_paragraph(next_paragraph, INT_MAX, index);
+            if (next_paragraph == NULL)
+            {
+                return NULL;
+            }
+            paragraph_index += index;
+        }
+        current_paragraph = next_paragraph;
+        paragraph_index++;
+    }
+    while (paragraph_index > target_index)
+    {
+        paragraph* previous_paragraph = current_paragraph->previous_paragraph;
+        if (previous_paragraph == NULL)
+        {
+            return NULL;
+        }
+        if (previous_paragraph->paragraph_start == NULL)
+        {
+            int first_index = paragraph_index - previous_paragraph->source_paragraphs;
+            int index = (target_index > first_index) ? target_index - first_index : 0;
+            previous_paragraph = build_paragraph(previous_paragraph, INT_MAX, index);
+            if (previous_paragraph == NULL)
+            {
+                return NULL;
+            }
+            paragraph_index = first_index + index + 1;
+        }
+        current_paragraph = previous_paragraph;
+        paragraph_index--;
+    }
+    return current_paragraph;
+}
+
+line* seek_offset(paragraph* current_paragraph, int offset)
+{
+    // The end of a line that has another after it is the start of that one
+    line* line_ptr = current_paragraph->paragraph_start;
+    while (line_ptr->next_line != NULL && offset >= line_ptr->number_characters)
+    {
+        offset -= line_ptr->number_characters;
+        line_ptr = line_ptr->next_line;
+    }
+    if (offset > line_ptr->number_characters)
+    {
+        return NULL;
+    }
+    move_cursor_to(line_ptr, offset);
+    return line_ptr;
+}
+
+int paragraph_offset(line* current_line)
+{
+    int offset = current_line->gap_start - current_line->buffer;
+    for (line* line_ptr = current_line->previous_line; line_ptr != NULL; line_ptr = line_ptr->previous_line)
+    {
+        offset += line_ptr->number_characters;
+    }
+    return offset;
+}
+
+int start_follow(char* filename, paragraph* paragraphs)
+{
+    follow_read_file = open(filename, O_RDONLY);
+    if (follow_read_file == -1)
+    {
+        return 1;
+    }
+    follow_notify = inotify_init1(IN_NONBLOCK);
+    if (follow_notify == -1 || inotify_add_watch(follow_notify, filename, IN_MODIFY) == -1)
+    {
+        return 1;
+    }
+    follow_buffer = malloc(FOLLOW_READ_SIZE);
+    if (follow_buffer == NULL)
+    {
+        return 1;
+    }
+
+    // Everything already in the file counts as appended to the empty document
+    follow_paragraph = paragraphs;
+    follow_offset = 0;
+    follow_pending = 1;
+
+    // getch gives up every so often so the file is looked at even while no keys are pressed
+    timeout(FOLLOW_INTERVAL);
+    return 0;
+}
+
+int follow_file(paragraph** cursor_paragraph, line** cursor_line)
+{
+    // Only whether anything was written matters, so the events are just drained
+    char events[4096];
+    while (read(follow_notify, events, sizeof(events)) > 0)
+    {
+        follow_pending = 1;
+    }
+    if (!follow_pending)
+    {
+        return 0;
+    }
+
+    struct stat file_info;
+    if (fstat(follow_read_file, &file_info) == -1)
+    {
+        return -1;
+    }
+    // A truncated file has started again, so its new text is read from the top like tail -f does
+    if (file_info.st_size < follow_offset)
+    {
+        follow_offset = 0;
+    }
+
+    // A cursor on the last line follows the text down, anywhere else it stays where it is
+    int cursor_row;
+    int last_row;
+    int cursor_start = row_start(*cursor_line, (*cursor_line)->gap_start - (*cursor_line)->buffer, &cursor_row);
+    int at_bottom = (*cursor_paragraph == follow_paragraph && (*cursor_line)->next_line == NULL && cursor_start == row_start(*cursor_line, (*cursor_line)->number_characters, &last_row));
+
+    // The new text goes onto the end of the last paragraph, so nothing already built is touched
+    off_t start_offset = follow_offset;
+    while (follow_offset < file_info.st_size && follow_offset - start_offset < FOLLOW_READ_LIMIT)
+    {
+        ssize_t read_size = pread(follow_read_file, follow_buffer, FOLLOW_READ_SIZE, follow_offset);
+        if (read_size == -1)
+        {
+            return -1;
+        }
+        // A character only partly written yet is left for the next read, once the rest of it is there
+        read_size = complete_length(follow_buffer, read_size);
+        if (read_size == 0)
+        {
+            break;
+        }
+        // A cursor at the bottom is put back at the end afterwards, as the empty line it can sit on goes when text is added
+        if (rewrap_paragraph(follow_paragraph, (*cursor_paragraph == follow_paragraph && !at_bottom) ? cursor_line : NULL) != 0)
+        {
+            return -1;
+        }
+        follow_paragraph = build_paragraphs(follow_paragraph, follow_buffer, follow_buffer + read_size);
+        if (follow_paragraph == NULL)
+        {
+            return -1;
+        }
+        follow_offset += read_size;
+    }
+
+    // Anything over the limit is taken in on the next look without waiting for another event
+    follow_pending = (follow_offset < file_info.st_size);
+    if (follow_offset == start_offset)
+    {
+        return 0;
+    }
+
+    if (at_bottom)
+    {
+        *cursor_paragraph = follow_paragraph;
+        *cursor_line = follow_paragraph->paragraph_end;
+        move_cursor_to(*cursor_line, (*cursor_line)->number_characters);
+        paragraph_index = -1;
+    }
+    return 1;
+}